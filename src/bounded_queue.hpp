@@ -0,0 +1,132 @@
+/*
+ * @author     Martin Høgh <mh@mapcentia.com>
+ * @copyright  2013-2022 MapCentia ApS
+ * @license    http://www.gnu.org/licenses/#AGPL  GNU AFFERO GENERAL PUBLIC LICENSE 3
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace ogr2postgis {
+    /**
+     * The order in which queued items are handed out. lpt (longest processing time first) pops the item with the
+     * highest estimated cost, spt the lowest, and fifo ignores the cost altogether.
+     */
+    enum class schedule_policy {
+        fifo,
+        lpt,
+        spt
+    };
+
+    /**
+     * A queue with a fixed capacity, used to connect the stages of the pipeline. Items are popped in the order given
+     * by the schedule policy, with ties broken by insertion order. push() blocks while the queue is full, try_push()
+     * and try_pop() never block. After close() no more items are accepted and the queue is drained once the remaining
+     * items have been popped.
+     */
+    template<typename T>
+    class bounded_queue {
+    public:
+        explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+        // Must be set before anything is pushed
+        void set_policy(schedule_policy p) {
+            std::scoped_lock lock(queueMutex);
+            policy = p;
+        }
+
+        bool push(T item, std::uint64_t cost = 0) {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+            if (closed) {
+                return false;
+            }
+            insert(std::move(item), cost);
+            return true;
+        }
+
+        bool try_push(T item, std::uint64_t cost = 0) {
+            std::scoped_lock lock(queueMutex);
+            if (closed || items.size() >= capacity) {
+                return false;
+            }
+            insert(std::move(item), cost);
+            return true;
+        }
+
+        bool try_pop(T &item) {
+            std::scoped_lock lock(queueMutex);
+            if (items.empty()) {
+                return false;
+            }
+            std::pop_heap(items.begin(), items.end(), comparator());
+            item = std::move(items.back().item);
+            items.pop_back();
+            notFull.notify_one();
+            return true;
+        }
+
+        bool empty() const {
+            std::scoped_lock lock(queueMutex);
+            return items.empty();
+        }
+
+        bool drained() const {
+            std::scoped_lock lock(queueMutex);
+            return closed && items.empty();
+        }
+
+        void close() {
+            {
+                std::scoped_lock lock(queueMutex);
+                closed = true;
+            }
+            notFull.notify_all();
+        }
+
+        void reopen() {
+            std::scoped_lock lock(queueMutex);
+            closed = false;
+        }
+
+    private:
+        struct entry {
+            T item;
+            std::uint64_t cost;
+            std::uint64_t seq;
+        };
+
+        // std heaps keep the largest element on top, so "less" means "popped later"
+        auto comparator() const {
+            return [p = policy](const entry &a, const entry &b) {
+                if (p == schedule_policy::lpt && a.cost != b.cost) {
+                    return a.cost < b.cost;
+                }
+                if (p == schedule_policy::spt && a.cost != b.cost) {
+                    return a.cost > b.cost;
+                }
+                return a.seq > b.seq;
+            };
+        }
+
+        void insert(T item, std::uint64_t cost) {
+            items.push_back({std::move(item), cost, nextSeq++});
+            std::push_heap(items.begin(), items.end(), comparator());
+        }
+
+        const size_t capacity;
+        std::vector<entry> items;
+        std::uint64_t nextSeq{0};
+        schedule_policy policy{schedule_policy::fifo};
+        bool closed{false};
+        mutable std::mutex queueMutex;
+        std::condition_variable notFull;
+    };
+}
@@ -27,8 +27,47 @@ int main(int argc, char *argv[]) {
             false).implicit_value(true);
     program.add_argument("-a", "--append").help("Append to existing layer instead of creating new.").default_value(
             false).implicit_value(true);
+    program.add_argument("--copy").help(
+            "Import with a native binary COPY over libpq instead of GDAL's PostgreSQL driver. Tables are created the same way.").default_value(
+            false).implicit_value(true);
+    program.add_argument("--defer-index").help(
+            "Create tables without a spatial index and build the indexes after all layers are imported.").default_value(
+            false).implicit_value(true);
+    program.add_argument("--maintenance-work-mem").help(
+            "maintenance_work_mem used for building deferred indexes, e.g. 1GB. Every index built at once gets this much.");
+    program.add_argument("--index-jobs").help(
+            "Number of deferred indexes built at once. Defaults to one per thread.");
+    program.add_argument("--incremental").help(
+            "Only import layers whose source has changed since the last import. Requires --import.").default_value(
+            false).implicit_value(true);
+    program.add_argument("--exact-count").help(
+            "Count features of every layer, even when the format has no stored count and the whole layer must be read. Otherwise such counts are reported as unknown.").default_value(
+            false).implicit_value(true);
+    program.add_argument("--profile").help(
+            "Read every feature of each layer once more and report its extent, vertex counts per feature, null and empty geometries and Z/M dimensions.").default_value(
+            false).implicit_value(true);
+    program.add_argument("--peak-memory").help(
+            "Report the peak resident memory of the process after the run, and how much the resident memory grew per analyzed layer after the first 50.").default_value(
+            false).implicit_value(true);
+    program.add_argument("-w", "--watch").help(
+            "Keep running and process files as they are added to or changed in the directory.").default_value(
+            false).implicit_value(true);
     program.add_argument("-c", "--connection").help(
             "PGDATASOURCE postgres datasource. E.g.\"PG:host='addr' dbname='databasename' port='5432' user='x' password='y'\"");
+    program.add_argument("--schedule").help(
+            "Order of analysis and import tasks. lpt (largest first), fifo (directory order) or spt (smallest first)").default_value(
+            std::string{"lpt"});
+    program.add_argument("-m", "--manifest").help(
+            "Scan manifest file. Results for unchanged files are read from it instead of analyzing the files again, and it's updated after the run.");
+    program.add_argument("--include").help(
+            "Only process files matching this glob. Can be repeated. A glob with a slash is matched against the path relative to the directory, otherwise against the file name.").append();
+    program.add_argument("--exclude").help(
+            "Skip files and directories matching this glob. Can be repeated. Excluded directories are never read. Matched like --include.").append();
+    program.add_argument("--shard").help(
+            "Only process shard i of N, given as i/N with 1 <= i <= N. Sources are assigned to shards by a hash of their path relative to the directory, so hosts running the other shards never overlap.");
+    program.add_argument("--shard-balance").help(
+            "Assign sources to shards by size instead of by hash. Walks the tree once more before processing.").default_value(
+            false).implicit_value(true);
     program.add_argument("path").help("[DIRECTORY|FILE]");
 //    program.add_epilog("Possible things include betingalw, chiz, and res.");
 
@@ -71,12 +110,88 @@ int main(int argc, char *argv[]) {
 //        config.nln = program.get("n");
     }
 
+    if (program.present("--manifest")) {
+        manifestFile = program.get("m");
+    }
+
+    if (auto rules = program.present<std::vector<std::string>>("--include")) {
+        includeRules = *rules;
+    }
+    if (auto rules = program.present<std::vector<std::string>>("--exclude")) {
+        excludeRules = *rules;
+    }
+
+    if (program.present("--shard")) {
+        auto shard = program.get("--shard");
+        unsigned i{0};
+        unsigned n{0};
+        char rest;
+        if (sscanf(shard.c_str(), "%u/%u%c", &i, &n, &rest) != 2 || i < 1 || i > n) {
+            std::cerr << "Invalid shard: " << shard << std::endl;
+            std::cerr << program;
+            std::exit(1);
+        }
+        shardIndex = i - 1;
+        shardCount = n;
+    }
+    if (program["--shard-balance"] == true) {
+        shardBalance = true;
+    };
+
     fallbackEncoding = program.get<std::string>("--encoding");
 
+    auto schedule = program.get<std::string>("--schedule");
+    if (schedule == "lpt") {
+        schedulePolicy = schedule_policy::lpt;
+    } else if (schedule == "fifo") {
+        schedulePolicy = schedule_policy::fifo;
+    } else if (schedule == "spt") {
+        schedulePolicy = schedule_policy::spt;
+    } else {
+        std::cerr << "Unknown schedule: " << schedule << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    }
+
     if (program["--append"] == true) {
         append = true;
 //        config.append = true;
     };
+    if (program["--copy"] == true) {
+        nativeCopy = true;
+    };
+    if (program["--defer-index"] == true) {
+        deferIndex = true;
+    };
+    if (program.present("--maintenance-work-mem")) {
+        maintenanceWorkMem = program.get("--maintenance-work-mem");
+    }
+    if (program.present("--index-jobs")) {
+        auto jobs = program.get("--index-jobs");
+        unsigned n{0};
+        char rest;
+        if (sscanf(jobs.c_str(), "%u%c", &n, &rest) != 1 || n < 1) {
+            std::cerr << "Invalid number of index jobs: " << jobs << std::endl;
+            std::cerr << program;
+            std::exit(1);
+        }
+        indexJobs = n;
+    }
+    if (program["--incremental"] == true) {
+        incremental = true;
+    };
+    if (program["--exact-count"] == true) {
+        exactCount = true;
+    };
+    if (program["--profile"] == true) {
+        profile = true;
+    };
+    if (program["--peak-memory"] == true) {
+        peakMemory = true;
+    };
+    if (program["--watch"] == true) {
+        watch = true;
+    };
     if (program["--p_multi"] == true) {
         p_multi = true;
 //        config.p_multi = true;
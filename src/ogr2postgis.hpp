@@ -9,11 +9,35 @@
 #include <chrono>
 #include <iostream>
 #include <vector>
+#include <atomic>
+#include <deque>
+#include <optional>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <set>
+#include <functional>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <fnmatch.h>
+#include <sys/resource.h>
+#include <cerrno>
+#include <climits>
+#include <cstring>
 #include "gdal/ogrsf_frmts.h"
 #include "tabulate.hpp"
 #include "thread_pool.hpp"
 #include "gdal/gdal_utils.h"
 #include "indicators.hpp"
+#include "bounded_queue.hpp"
+#include "pg_copy.hpp"
+#include <libpq-fe.h>
 
 using namespace std;
 using namespace tabulate;
@@ -34,6 +58,55 @@ namespace ogr2postgis {
         return (toupper(a) == toupper(b));
     }
 
+    vector<string> lowercase(vector<string> strings) {
+        for (string &str: strings) {
+            transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return tolower(c); });
+        }
+        return strings;
+    }
+
+    // Matches the extension of a file name against a set of lowercase extensions without allocating
+    bool hasExtension(const char *name, const vector<string> &lowercaseExtensions) {
+        const char *dot = strrchr(name, '.');
+        if (dot == nullptr || dot == name) {
+            return false;
+        }
+        char extension[16];
+        size_t length{0};
+        for (const char *c = dot; *c != '\0'; c++) {
+            if (length == sizeof(extension) - 1) {
+                return false;
+            }
+            extension[length++] = (char) tolower((unsigned char) *c);
+        }
+        for (const string &candidate: lowercaseExtensions) {
+            if (candidate.size() == length && memcmp(candidate.data(), extension, length) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 64-bit FNV-1a. Stable across runs and hosts, unlike std::hash.
+    uint64_t fnv1a(const string &str, uint64_t hash = 14695981039346656037ULL) {
+        for (unsigned char c: str) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    string quoteLiteral(const string &str) {
+        string quoted{"'"};
+        for (char c: str) {
+            quoted += c;
+            if (c == '\'') {
+                quoted += c;
+            }
+        }
+        return quoted + "'";
+    }
+
     string getGeomType (int t) {
         string type;
         switch (t) {
@@ -69,7 +142,86 @@ namespace ogr2postgis {
     bool import{false};
     bool p_multi{false};
     bool append{false};
+    bool incremental{false};
+    bool watch{false};
+    bool exactCount{false};
+    bool profile{false};
+    bool peakMemory{false};
+    // With --peak-memory the resident size is also taken once memoryWarmupLayers layers are in and again when the
+    // analysis ends. Steady growth per layer in between is a leak in the analysis, not a big layer.
+    const size_t memoryWarmupLayers{50};
+    long warmResidentKb{0};
+    long analyzedResidentKb{0};
+    size_t analyzedLayers{0};
+    // Import with a native binary COPY over libpq instead of GDALVectorTranslate
+    bool nativeCopy{false};
+    // Buffered COPY data is sent to the server in chunks of this size
+    const size_t copyFlushSize{1 << 20};
+    // With --defer-index tables are loaded without a spatial index, and the indexes are built after the imports
+    bool deferIndex{false};
+    string maintenanceWorkMem;
+    // Number of indexes built at once, 0 for one per thread
+    unsigned indexJobs{0};
+    size_t indexesBuilt{0};
+    int64_t indexMillis{0};
+    const chrono::milliseconds watchDebounce{2000};
+    const string importsTable{"ogr2postgis_imports"};
+    atomic<size_t> layersSkipped{0};
     const int maxFeatures{1000};
+    // By the rule of three, when this many stratified samples in a row agree on the type, a type making up more than
+    // 1% of the layer would have shown up with 95% confidence
+    const int stableSamples{300};
+    const size_t queueCapacity{1024};
+    schedule_policy schedulePolicy{schedule_policy::lpt};
+    const vector<string> extensions{{".tab", ".shp", ".gml", ".geojson", ".gpkg", ".fgb"}};
+    // Datasets stored as a directory, which are opened as a whole and never walked into
+    const vector<string> directoryExtensions{{".gdb"}};
+    const vector<string> lowercaseExtensions = lowercase(extensions);
+    const vector<string> lowercaseDirectoryExtensions = lowercase(directoryExtensions);
+    // Archives are read in place through GDAL's virtual file systems
+    const vector<pair<string, string>> archivePrefixes{{{".zip", "/vsizip/"}, {".tar", "/vsitar/"},
+                                                        {".tgz", "/vsitar/"}, {".tar.gz", "/vsitar/"}}};
+    vector<string> includeRules;
+    vector<string> excludeRules;
+    // The walked directory with a trailing slash. Glob rules are matched against paths relative to it.
+    string walkRoot;
+    // This process handles shard shardIndex (0-based) of shardCount
+    unsigned shardIndex{0};
+    unsigned shardCount{1};
+    bool shardBalance{false};
+    // Set during the size-balancing pre-pass, where sources are only recorded
+    bool collecting{false};
+    std::mutex shardMutex;
+    vector<pair<string, uint64_t>> shardPlan;
+    unordered_map<string, unsigned> shardAssignment;
+    vector<uint64_t> shardFiles;
+    vector<uint64_t> shardBytes;
+    atomic<size_t> filesFound{0};
+    atomic<size_t> dirsPending{0};
+    string manifestFile;
+    // Identifies the state of a source on disk. If none of it has changed the source is assumed to be unchanged.
+    struct sourceKey {
+        uint64_t size{0};
+        int64_t mtime{0};
+        uint64_t inode{0};
+
+        bool operator==(const sourceKey &other) const {
+            return size == other.size && mtime == other.mtime && inode == other.inode;
+        }
+    };
+    // Collected in one extra pass over all features of a layer when profiling
+    struct layerProfile {
+        bool profiled{false};
+        OGREnvelope extent;
+        GIntBig geometries{0};
+        GIntBig nullGeometries{0};
+        GIntBig emptyGeometries{0};
+        GIntBig vertices{0};
+        GIntBig minVertices{0};
+        GIntBig maxVertices{0};
+        bool hasZ{false};
+        bool hasM{false};
+    };
     struct layer {
         string driverName;
         GIntBig featureCount;
@@ -82,8 +234,27 @@ namespace ogr2postgis {
         int layerIndex;
         string error;
         bool singleMultiMixed;
+        sourceKey key;
+        layerProfile profile;
+        // The client encoding the layer's strings are imported with, and how it was found: "driver" when GDAL
+        // hands out UTF-8, "cpg" or "ldid" from the Shapefile's code page, "sample" when the strings read were
+        // valid UTF-8 and "sample-invalid" when they weren't, in which case it's the fallback encoding
+        string encoding{"UTF8"};
+        string encodingSource{"driver"};
+    };
+    struct manifestEntry {
+        sourceKey key;
+        vector<layer> layers;
     };
-    vector<struct layer> layers;
+    // Loaded before the run and only read during it
+    unordered_map<string, manifestEntry> manifest;
+    // A deque keeps references to existing records valid while the analysis stage appends new ones
+    deque<struct layer> layers;
+    bounded_queue<string> sourceQueue{queueCapacity};
+    bounded_queue<size_t> importQueue{queueCapacity};
+    atomic<bool> analyzing{false};
+    atomic<int> analysesRunning{0};
+    atomic<int64_t> busyMicros{0};
     struct ctx {
         int layerIndex{};
         bool error{false};
@@ -92,9 +263,19 @@ namespace ogr2postgis {
     void
     translate(layer l, const string &encoding, int index, bool first);
 
+    void
+    copyImport(layer l, const string &encoding, int index, bool first);
+
+    void deferIndexBuild(const string &table, size_t index, const string &fingerprintSql);
+
+    void buildIndexes();
+
+    void createImportsTable();
+
     static void pgErrorHandler(CPLErr e, CPLErrorNum n, const char *msg) {
         string str(msg);
         ctx *myctx = (ctx *) CPLGetErrorHandlerUserData();
+        std::scoped_lock lock(mutex);
         layers[myctx->layerIndex].error = str;
         myctx->error = true;
     }
@@ -121,241 +302,2306 @@ namespace ogr2postgis {
             },
             indicators::option::PostfixText{"Importing to PostgreSQL"},
     };
+    // Analysis and import run at the same time when importing, so both bars are drawn together
+    unique_ptr<indicators::MultiProgress<indicators::ProgressBar, 2>> bars;
 
-    inline void openSource(string file) {
-        layer l = {"", 0, "", "", "", file, "",
-                   "", 0, "", false};
-        CPLPushErrorHandlerEx(&openErrorHandler, &l);
-        auto *poDS = (GDALDataset *) GDALOpenEx(file.c_str(), GDAL_OF_VECTOR, nullptr, nullptr, nullptr);
-        if (!l.error.empty() || poDS == nullptr) {
-            l.error= !l.error.empty() ? l.error : "Unable to open file";
-            std::scoped_lock lock;
-            layers.push_back(l);
+    bool showProgress{true};
+
+    void tickRead() {
+        if (!showProgress) {
+            return;
+        }
+        if (bars) {
+            bars->tick<0>();
+        } else {
             readBar.tick();
+        }
+    }
+
+    void tickImport() {
+        if (!showProgress) {
             return;
         }
-        OGRSpatialReference *projection;
-        char *wktString{nullptr};
-        const char *authorityName;
-        const char *authorityCode;
-        string authStr;
-        int layerCount{poDS->GetLayerCount()};
-        string hasWkt{"True"};
-        string layerName;
-        string driverName{poDS->GetDriverName()};
-        for (int i = 0; i < layerCount; i++) {
-            OGRLayer *layer{poDS->GetLayer(i)};
-            const OGRSpatialReference *reference = layer->GetSpatialRef();
-            if (reference != nullptr) {
-                projection = layer->GetLayerDefn()->OGRFeatureDefn::GetGeomFieldDefn(0)->GetSpatialRef();
-                projection->exportToWkt(&wktString);
-                authorityName = projection->GetAuthorityName(nullptr);
-                authorityCode = projection->GetAuthorityCode(nullptr);
-                if (authorityName != nullptr && authorityCode != nullptr) {
-                    authStr = string(authorityName) + ":" + string(authorityCode);
-                } else {
-                    authStr = "-";
-                }
-            } else {
-                authorityName = "";
-                authorityCode = "Na";
-                hasWkt = "False";
-                authStr = "-";
-            }
-            // Count features
-            GIntBig featureCount = layer->GetFeatureCount(1);
-            int count{0};
-            string type;
-            string typeDeteced;
-            string typeFromLayer;
-            string tmpType;
-            bool singleMultiMixed{false};
-            OGRFeature *poFeature;
-            typeFromLayer = getGeomType(layer->GetGeomType());
-            while ((poFeature = layer->GetNextFeature()) != nullptr) {
-                OGRGeometry *poGeometry = poFeature->GetGeometryRef();
-                if (poGeometry != nullptr) {
-                    typeDeteced = getGeomType(wkbFlatten(poGeometry->getGeometryType()));
-                }
-                count++;
-                if (count == maxFeatures || count == featureCount) {
-                    break;
-                } else {
-                    if (!tmpType.empty() &&
-                        (tmpType != typeDeteced && tmpType != "multi" + typeDeteced && tmpType != typeDeteced.substr(5, typeDeteced.length()))) {
-                        typeDeteced = "geometry";
-                        break;
-                    }
-                    if (!tmpType.empty() && (tmpType == "multi" + typeDeteced || tmpType == typeDeteced.substr(5, typeDeteced.length()))) {
-                        singleMultiMixed = true;
-                    }
-                    tmpType = typeDeteced;
-                    continue;
-                }
+        bars->tick<1>();
+    }
+
+    // Target connections are kept open between layers and, in watch mode, between events. Each one remembers the
+    // client encoding last set on it, so it's only changed when a layer needs another one.
+    struct pooledConnection {
+        GDALDatasetH pgDs{nullptr};
+        string encoding;
+    };
+    std::mutex connectionMutex;
+    vector<pooledConnection> idleConnections;
+
+    pooledConnection acquireConnection() {
+        {
+            std::scoped_lock lock(connectionMutex);
+            if (!idleConnections.empty()) {
+                pooledConnection pooled = idleConnections.back();
+                idleConnections.pop_back();
+                return pooled;
             }
-            if (singleMultiMixed || typeFromLayer.empty()) {
-                type = typeDeteced;
-            } else {
-                type = typeFromLayer;
+        }
+        return {GDALOpenEx(connection.c_str(), GDAL_OF_UPDATE | GDAL_OF_VECTOR, nullptr, nullptr, nullptr), ""};
+    }
+
+    void releaseConnection(const pooledConnection &pooled) {
+        if (pooled.pgDs == nullptr) {
+            return;
+        }
+        GDALFlushCache(pooled.pgDs);
+        std::scoped_lock lock(connectionMutex);
+        idleConnections.push_back(pooled);
+    }
+
+    // Native connections for --copy. The client encoding is set per import, so these aren't keyed on it.
+    vector<PGconn *> idleCopyConnections;
+
+    // libpq takes the GDAL connection string without its "PG:" prefix
+    string connectionInfo() {
+        return strncasecmp(connection.c_str(), "PG:", 3) == 0 ? connection.substr(3) : connection;
+    }
+
+    PGconn *acquireCopyConnection() {
+        {
+            std::scoped_lock lock(connectionMutex);
+            if (!idleCopyConnections.empty()) {
+                PGconn *conn = idleCopyConnections.back();
+                idleCopyConnections.pop_back();
+                return conn;
             }
+        }
+        return PQconnectdb(connectionInfo().c_str());
+    }
 
+    // Only connections that are healthy and outside a transaction are kept
+    void releaseCopyConnection(PGconn *conn) {
+        if (conn == nullptr) {
+            return;
+        }
+        if (PQstatus(conn) != CONNECTION_OK || PQtransactionStatus(conn) != PQTRANS_IDLE) {
+            PQfinish(conn);
+            return;
+        }
+        std::scoped_lock lock(connectionMutex);
+        idleCopyConnections.push_back(conn);
+    }
 
-            l = {driverName, featureCount, type, poDS->GetLayer(i)->GetName(), hasWkt, file, wktString == nullptr ? "" : string(wktString),
-                 authStr, i, "", singleMultiMixed};
-            {
-                std::scoped_lock lock;
-                layers.push_back(l);
+    void closeConnections() {
+        std::scoped_lock lock(connectionMutex);
+        for (const pooledConnection &pooled: idleConnections) {
+            GDALClose(pooled.pgDs);
+        }
+        idleConnections.clear();
+        for (PGconn *conn: idleCopyConnections) {
+            PQfinish(conn);
+        }
+        idleCopyConnections.clear();
+    }
+
+    // Every stage worker holds its own target connections for the whole run, so its layers are imported without a
+    // new handshake each time. They're taken from the pools above when first needed, or earlier while the worker
+    // has nothing else to do, and handed back when the run is over.
+    struct workerConnections {
+        pooledConnection gdal;
+        PGconn *copy{nullptr};
+        chrono::steady_clock::time_point lastUsed;
+    };
+    thread_local workerConnections worker;
+    // A connection that has been idle for longer is checked before it's used again
+    const chrono::seconds connectionIdleCheck{30};
+
+    bool connectionAlive(GDALDatasetH pgDs) {
+        CPLPushErrorHandler(CPLQuietErrorHandler);
+        OGRLayer *result = GDALDataset::FromHandle(pgDs)->ExecuteSQL("SELECT 1", nullptr, nullptr);
+        CPLPopErrorHandler();
+        if (result == nullptr) {
+            return false;
+        }
+        GDALDataset::FromHandle(pgDs)->ReleaseResultSet(result);
+        return true;
+    }
+
+    bool connectionAlive(PGconn *conn) {
+        if (PQstatus(conn) != CONNECTION_OK) {
+            return false;
+        }
+        PGresult *result = PQexec(conn, "SELECT 1");
+        bool alive = PQresultStatus(result) == PGRES_TUPLES_OK;
+        PQclear(result);
+        return alive;
+    }
+
+    bool idleTooLong() {
+        auto now = chrono::steady_clock::now();
+        bool check = now - worker.lastUsed > connectionIdleCheck;
+        worker.lastUsed = now;
+        return check;
+    }
+
+    // A connection that saw an error may be left in an aborted transaction, so it's closed instead of reused
+    void dropWorkerConnection() {
+        if (worker.gdal.pgDs != nullptr) {
+            GDALClose(worker.gdal.pgDs);
+        }
+        worker.gdal = {};
+    }
+
+    // Returns the worker's connection, reconnecting if it has gone away. The client encoding is set on the
+    // connection itself, as the PGCLIENTENCODING environment variable is shared by all threads and only read when
+    // connecting.
+    GDALDatasetH workerConnection(const string &encoding) {
+        bool check = idleTooLong();
+        if (worker.gdal.pgDs != nullptr && check && !connectionAlive(worker.gdal.pgDs)) {
+            dropWorkerConnection();
+        }
+        if (worker.gdal.pgDs == nullptr) {
+            worker.gdal = acquireConnection();
+            if (worker.gdal.pgDs != nullptr && check && !connectionAlive(worker.gdal.pgDs)) {
+                GDALClose(worker.gdal.pgDs);
+                worker.gdal = {GDALOpenEx(connection.c_str(), GDAL_OF_UPDATE | GDAL_OF_VECTOR, nullptr, nullptr,
+                                          nullptr), ""};
             }
-            OGRFeature::DestroyFeature(poFeature);
         }
-        readBar.tick();
-        GDALClose(poDS);
+        if (worker.gdal.pgDs != nullptr && worker.gdal.encoding != encoding) {
+            string sql = "SET client_encoding TO " + quoteLiteral(encoding);
+            GDALDataset::FromHandle(worker.gdal.pgDs)->ExecuteSQL(sql.c_str(), nullptr, nullptr);
+            worker.gdal.encoding = encoding;
+        }
+        return worker.gdal.pgDs;
     }
 
-    void start(string path) {
-        GDALAllRegister();
-        vector<string> extensions{{".tab", ".shp", ".gml", ".geojson", ".gpkg", ".gdb", ".fgb"}};
-        vector<string> fileNames;
-        string file;
-        string fileExtension;
-        if (path.find(".gdb") != string::npos) {
-            fileNames.push_back(path);
+    PGconn *workerCopyConnection() {
+        bool check = idleTooLong();
+        if (worker.copy != nullptr && (PQstatus(worker.copy) != CONNECTION_OK || (check && !connectionAlive(worker.copy)))) {
+            PQreset(worker.copy);
+        }
+        if (worker.copy == nullptr) {
+            worker.copy = acquireCopyConnection();
+            if (check && PQstatus(worker.copy) == CONNECTION_OK && !connectionAlive(worker.copy)) {
+                PQreset(worker.copy);
+            }
+        }
+        return worker.copy;
+    }
+
+    // Connects ahead of the first import, so the handshake overlaps with analysis. A failure is reported by the
+    // import that needs the connection.
+    void prewarmConnection() {
+        CPLPushErrorHandler(CPLQuietErrorHandler);
+        if (nativeCopy) {
+            workerCopyConnection();
         } else {
-            try {
-                for (auto &p: filesystem::recursive_directory_iterator(path)) {
-                    if (!nln.empty() && import && !append) {
-                        printf("ERROR: Can't use alternative table name for importing directories. All tables will be named alike.\n");
-                        exit(1);
-                    }
-                    file = p.path().string();
-                    fileExtension = p.path().extension().string();
-                    if (caseInsCompare(fileExtension, extensions)) {
-                        fileNames.push_back(file);
-                    }
-                }
-            } catch (const std::exception &e) {
-                if (!filesystem::exists(path)) {
-                    printf("ERROR: Could not open directory or file.\n");
-                    exit(1);
-                };
-                fileNames.push_back(path);
+            workerConnection("UTF8");
+        }
+        CPLPopErrorHandler();
+    }
+
+    void returnWorkerConnections() {
+        releaseConnection(worker.gdal);
+        worker.gdal = {};
+        releaseCopyConnection(worker.copy);
+        worker.copy = nullptr;
+    }
+
+    void importLayer(size_t index);
+
+    // Source datasets stay open on the worker that opened them, so analysis and import of a file only pay for the
+    // open once per worker. GDAL handles can't be shared between threads, hence one cache per worker. The least
+    // recently used handle is closed once the cache is full, which keeps the number of open files bounded.
+    const size_t sourceHandleCacheSize{4};
+    thread_local list<pair<string, GDALDataset *>> sourceHandles;
+
+    GDALDataset *openCached(const string &file) {
+        for (auto it = sourceHandles.begin(); it != sourceHandles.end(); ++it) {
+            if (it->first == file) {
+                sourceHandles.splice(sourceHandles.begin(), sourceHandles, it);
+                return it->second;
             }
         }
-        readBar.set_option(indicators::option::MaxProgress{fileNames.size()});
-        for (const string &fileName: fileNames) {
-            pool.push_task(openSource, fileName);
+        auto *poDS = (GDALDataset *) GDALOpenEx(file.c_str(), GDAL_OF_VECTOR, nullptr, nullptr, nullptr);
+        if (poDS == nullptr) {
+            return nullptr;
+        }
+        if (sourceHandles.size() >= sourceHandleCacheSize) {
+            GDALClose(sourceHandles.back().second);
+            sourceHandles.pop_back();
+        }
+        sourceHandles.emplace_front(file, poDS);
+        return poDS;
+    }
+
+    // Closes the handle of a file, e.g. when it reported an error on open
+    void closeCached(const string &file) {
+        for (auto it = sourceHandles.begin(); it != sourceHandles.end(); ++it) {
+            if (it->first == file) {
+                GDALClose(it->second);
+                sourceHandles.erase(it);
+                return;
+            }
+        }
+    }
+
+    // Called by every worker when a run is over, so files changed before the next run in watch mode are read anew
+    void closeCachedAll() {
+        for (auto &handle: sourceHandles) {
+            GDALClose(handle.second);
+        }
+        sourceHandles.clear();
+    }
+
+    // The feature count, or when it's unknown an estimate of one feature per KB of source
+    uint64_t importCost(const layer &l) {
+        return l.featureCount >= 0 ? (uint64_t) l.featureCount : l.key.size / 1024;
+    }
+
+    // Stores a finished layer record and returns its index
+    long residentKb() {
+        ifstream statm("/proc/self/statm");
+        long size{0};
+        long resident{0};
+        statm >> size >> resident;
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+
+    size_t storeLayer(const layer &l) {
+        std::scoped_lock lock(mutex);
+        layers.push_back(l);
+        if (peakMemory && layers.size() == memoryWarmupLayers) {
+            warmResidentKb = residentKb();
         }
-        pool.wait_for_tasks();
-        std::cout << "\r" << std::flush;
-        int i{0};
-        // Import in PostGIS
         if (import) {
-            importBar.set_option(indicators::option::MaxProgress{layers.size()});
-            for (const struct layer &l: layers) {
-                if (l.error.empty()) {
-                    pool.push_task(translate, l, "UTF8", i, true);
-                } else {
-                    importBar.tick();
-                }
-                i++;
-            };
-            pool.wait_for_tasks();
+            importBar.set_option(indicators::option::MaxProgress{layers.size() + (analyzing ? 1 : 0)});
         }
-        // Print out
-        Table table;
-        table.add_row({"Driver", "Count", "Type", "TypeN", "Layer no.", "Name", "Proj", "Auth", "File", "Error"});
-        table[0].format()
-                .font_align(FontAlign::center)
-                .font_style({FontStyle::underline, FontStyle::bold});
-        i = 0;
-        for (const struct layer &l: layers) {
-            table.add_row({l.driverName.c_str(), to_string(l.featureCount), l.type + (l.singleMultiMixed ? "(m)" : ""),
-                           to_string(l.layerIndex), l.layerName,
-                           l.hasWkt, l.authStr, l.file, l.error}).format();
-            i++;
-            if (!l.error.empty()) {
-                table[i][8].format().font_color(Color::red);
+        return layers.size() - 1;
+    }
+
+    // Hands a stored layer record straight to the import stage
+    void importStored(size_t index) {
+        if (!import) {
+            return;
+        }
+        uint64_t cost;
+        bool failed;
+        {
+            std::scoped_lock lock(mutex);
+            cost = importCost(layers[index]);
+            failed = !layers[index].error.empty();
+        }
+        if (!failed) {
+            // Import right away on this worker when the queue is full, the other workers are busy anyway
+            if (!importQueue.try_push(index, cost)) {
+                importLayer(index);
             }
+        } else {
+            tickImport();
+        }
+    }
+
+    void addLayer(const layer &l) {
+        importStored(storeLayer(l));
+    }
 
+    const char *archivePrefix(const char *name);
+
+    // The archive file a /vsizip/ or /vsitar/ path points into, or the path itself for plain files
+    string archiveOf(const string &path) {
+        if (path.rfind("/vsizip/", 0) != 0 && path.rfind("/vsitar/", 0) != 0) {
+            return path;
         }
-        std::cout << "\r" << std::flush;
-        std::cout << table << std::endl;
-        auto stopTime = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stopTime - startTime);
-        printf("Total of %zu layer(s) in %zu file(s) processed in %ldms using %s\n", layers.size(), fileNames.size(),
-               lround(duration.count()/1000), GDALVersionInfo("--version"));
+        string rest = path.substr(8);
+        for (size_t slash = rest.find('/', 1); slash != string::npos; slash = rest.find('/', slash + 1)) {
+            string candidate = rest.substr(0, slash);
+            if (archivePrefix(candidate.c_str()) != nullptr) {
+                return candidate;
+            }
+        }
+        return rest;
     }
-    inline void
-    translate(layer l, const string &encoding, int index, bool first) {
-        char **argv{nullptr};
-        string altName = l.layerName;
-        string env = "PGCLIENTENCODING=" + encoding;
-        ctx myctx = {
-                .layerIndex =  index,
-                .error = false,
-        };
-        CPLPushErrorHandlerEx(&pgErrorHandler, &myctx);
-        putenv((char *) env.c_str());
-        setvbuf(stdout, nullptr, _IOFBF, BUFSIZ);
-        if (!nln.empty()) {
-            altName = nln;
-            if (l.layerIndex > 0) {
-                altName = altName + "_" + to_string(l.layerIndex);
+
+    // Directory datasets are keyed on the sum of their file sizes and the newest mtime, because files inside a
+    // directory can change without touching the directory itself
+    // Members of an archive are keyed on the archive file
+    sourceKey statSource(const string &file) {
+        sourceKey key;
+        struct stat st{};
+        if (stat(archiveOf(file).c_str(), &st) != 0) {
+            return key;
+        }
+        key.size = (uint64_t) st.st_size;
+        key.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        key.inode = (uint64_t) st.st_ino;
+        if (S_ISDIR(st.st_mode)) {
+            error_code ec;
+            key.size = 0;
+            for (auto &entry: filesystem::directory_iterator(file, ec)) {
+                struct stat est{};
+                if (stat(entry.path().c_str(), &est) == 0) {
+                    key.size += (uint64_t) est.st_size;
+                    key.mtime = max(key.mtime, (int64_t) est.st_mtim.tv_sec * 1000000000 + est.st_mtim.tv_nsec);
+                }
             }
         }
-        altName = schema + "." + altName;
-        if ((l.type == "point" || l.type == "linestring" || l.type == "polygon") && (l.singleMultiMixed || p_multi)) {
-            l.type = "multi" + l.type;
+        return key;
+    }
+
+    string escapeField(const string &str) {
+        string escaped;
+        escaped.reserve(str.size());
+        for (char c: str) {
+            switch (c) {
+                case '\\':
+                    escaped += "\\\\";
+                    break;
+                case '\t':
+                    escaped += "\\t";
+                    break;
+                case '\n':
+                    escaped += "\\n";
+                    break;
+                case '\r':
+                    escaped += "\\r";
+                    break;
+                default:
+                    escaped += c;
+            }
         }
-        const char *targetSrs = reinterpret_cast<const char *>(l.wktString != "" ? l.wktString.c_str() : s_srs.c_str());
-        if (targetSrs == nullptr) {
-            layers[index].error = "Can't impoort without source srs";
-            CSLDestroy(argv);
-            importBar.tick();
+        return escaped;
+    }
+
+    vector<string> splitFields(const string &line) {
+        vector<string> fields(1);
+        for (size_t i = 0; i < line.size(); i++) {
+            char c = line[i];
+            if (c == '\t') {
+                fields.emplace_back();
+            } else if (c == '\\' && i + 1 < line.size()) {
+                char next = line[++i];
+                fields.back() += next == 't' ? '\t' : next == 'n' ? '\n' : next == 'r' ? '\r' : next;
+            } else {
+                fields.back() += c;
+            }
+        }
+        return fields;
+    }
+
+    const string manifestHeader{"ogr2postgis-manifest\t3"};
+    const size_t manifestFieldCount{15};
+
+    // The manifest holds one line per layer. Sources that failed to open are never stored, so they are retried on
+    // the next run.
+    void loadManifest() {
+        ifstream in(manifestFile);
+        string line;
+        if (!in || !getline(in, line) || line != manifestHeader) {
             return;
         }
-        argv = CSLAddString(argv, "-f");
-        argv = CSLAddString(argv, "PostgreSQL");
-        if (append) {
-            argv = CSLAddString(argv, "-update");
-            argv = CSLAddString(argv, "-append");
+        while (getline(in, line)) {
+            vector<string> f = splitFields(line);
+            if (f.size() != manifestFieldCount) {
+                continue;
+            }
+            try {
+                sourceKey key{stoull(f[1]), stoll(f[2]), stoull(f[3])};
+                layer l = {f[4], stoll(f[5]), f[6], f[7], f[8], f[0], f[9], f[10], stoi(f[11]), "",
+                           f[12] == "1", key};
+                // The fallback encoding may differ from the one in use when the entry was written
+                l.encodingSource = f[14];
+                l.encoding = l.encodingSource == "sample-invalid" ? fallbackEncoding : f[13];
+                manifestEntry &entry = manifest[f[0]];
+                entry.key = key;
+                entry.layers.push_back(l);
+            } catch (const std::exception &e) {
+                continue;
+            }
         }
-        argv = CSLAddString(argv, "-overwrite");
-        argv = CSLAddString(argv, "-lco");
-        argv = CSLAddString(argv, "GEOMETRY_NAME=the_geom");
-        argv = CSLAddString(argv, "-lco");
-        argv = CSLAddString(argv, "FID=gid");
-        argv = CSLAddString(argv, "-lco");
-        argv = CSLAddString(argv, "PRECISION=NO");
-        argv = CSLAddString(argv, "-nlt");
-        argv = CSLAddString(argv, l.type.c_str());
-        argv = CSLAddString(argv, "-s_srs"); // source projection
-        argv = CSLAddString(argv, targetSrs);
-        argv = CSLAddString(argv, "-t_srs");
-        argv = CSLAddString(argv,
-                            reinterpret_cast<const char *>(strcmp(l.authStr.c_str(), "-") != 0 ? l.authStr.c_str() :
-                                                           !t_srs.empty() ? t_srs.c_str()
-                                                                          : "EPSG:4326")); // Convert to this
-        argv = CSLAddString(argv, "-nln");
-        argv = CSLAddString(argv, altName.c_str());
-        argv = CSLAddString(argv, l.layerName.c_str());
+    }
 
-        GDALDatasetH pgDs = GDALOpenEx(connection.c_str(), GDAL_OF_UPDATE | GDAL_OF_VECTOR,
-                                       nullptr, nullptr, nullptr);
-        GDALDatasetH sourceDs = GDALOpenEx(l.file.c_str(), GDAL_OF_VECTOR, nullptr, nullptr, nullptr);
+    // Replaces the entries of every source seen in this run. A full run also drops the sources that are gone.
+    // A source with a failed layer isn't stored at all, as an entry without that layer would hide it for good.
+    void updateManifest(bool fullRun) {
+        unordered_map<string, manifestEntry> seen;
+        set<string> failed;
+        for (const struct layer &l: layers) {
+            if (l.driverName.empty() || !l.error.empty()) {
+                failed.insert(l.file);
+                continue;
+            }
+            manifestEntry &entry = seen[l.file];
+            entry.key = l.key;
+            entry.layers.push_back(l);
+        }
+        for (const string &file: failed) {
+            seen.erase(file);
+            manifest.erase(file);
+        }
+        if (fullRun) {
+            manifest = std::move(seen);
+        } else {
+            for (auto &entry: seen) {
+                manifest[entry.first] = std::move(entry.second);
+            }
+        }
+    }
 
-        int bUsageError{FALSE};
-        GDALVectorTranslateOptions *opt = GDALVectorTranslateOptionsNew(argv, nullptr);
-        auto *dst = (GDALDataset *) GDALVectorTranslate(nullptr, pgDs, 1, &sourceDs, opt, &bUsageError);
-        GDALVectorTranslateOptionsFree(opt);
-        GDALClose(dst);
-        CSLDestroy(argv);
-        // If error we try with the fallback encoding
-        if (myctx.error && first) {
-            layers[index].error = "";
-            translate(l, fallbackEncoding, index, false);
-            return;
+    void writeManifestLine(ofstream &out, const layer &l) {
+        out << escapeField(l.file) << "\t" << l.key.size << "\t" << l.key.mtime << "\t" << l.key.inode << "\t"
+            << escapeField(l.driverName) << "\t" << l.featureCount << "\t" << escapeField(l.type) << "\t"
+            << escapeField(l.layerName) << "\t" << l.hasWkt << "\t" << escapeField(l.wktString) << "\t"
+            << escapeField(l.authStr) << "\t" << l.layerIndex << "\t" << (l.singleMultiMixed ? "1" : "0") << "\t"
+            << escapeField(l.encoding) << "\t" << escapeField(l.encodingSource) << "\n";
+    }
+
+    void saveManifest() {
+        string tmpFile = manifestFile + ".tmp";
+        ofstream out(tmpFile, ios::trunc);
+        out << manifestHeader << "\n";
+        for (const auto &entry: manifest) {
+            for (const struct layer &l: entry.second.layers) {
+                writeManifestLine(out, l);
+            }
+        }
+        out.close();
+        error_code ec;
+        if (out) {
+            filesystem::rename(tmpFile, manifestFile, ec);
+        }
+        if (!out || ec) {
+            printf("WARNING: Could not write manifest %s\n", manifestFile.c_str());
+        }
+    }
+
+    // Index of the n'th stratified sample in a layer. The positions follow the van der Corput sequence, which keeps
+    // every prefix of the sample evenly spread over the layer, so sampling can stop at any point.
+    GIntBig samplePosition(int n, GIntBig featureCount) {
+        double position{0};
+        for (double weight = 0.5; n > 0; n >>= 1, weight /= 2) {
+            if (n & 1) {
+                position += weight;
+            }
         }
-        importBar.tick();
+        return (GIntBig) (position * (double) featureCount);
+    }
+
+    // What's known about a projection. Trees tend to hold many layers sharing a few projections, so each distinct
+    // one is resolved once and shared by every layer and worker after that.
+    struct srsInfo {
+        string wkt;
+        string authStr;
+    };
+    struct srsEntry {
+        once_flag resolved;
+        srsInfo info;
+    };
+    std::mutex srsMutex;
+    unordered_map<string, unique_ptr<srsEntry>> srsCache;
+
+    // Projections without an authority code are matched against the EPSG database, and the best match is taken
+    // when GDAL is at least 90% confident about it
+    const int srsMatchConfidence{90};
+
+    const srsInfo &resolveSrs(const OGRSpatialReference *projection) {
+        char *wkt{nullptr};
+        projection->exportToWkt(&wkt);
+        string wktString = wkt == nullptr ? "" : wkt;
+        CPLFree(wkt);
+        srsEntry *entry;
+        {
+            std::scoped_lock lock(srsMutex);
+            unique_ptr<srsEntry> &cached = srsCache[wktString];
+            if (!cached) {
+                cached = make_unique<srsEntry>();
+            }
+            entry = cached.get();
+        }
+        call_once(entry->resolved, [&] {
+            entry->info.wkt = wktString;
+            entry->info.authStr = "-";
+            const char *authorityName = projection->GetAuthorityName(nullptr);
+            const char *authorityCode = projection->GetAuthorityCode(nullptr);
+            if (authorityName != nullptr && authorityCode != nullptr) {
+                entry->info.authStr = string(authorityName) + ":" + string(authorityCode);
+                return;
+            }
+            int matchCount{0};
+            int *confidence{nullptr};
+            OGRSpatialReference **matches = projection->FindMatches(nullptr, &matchCount, &confidence);
+            if (matchCount > 0 && confidence[0] >= srsMatchConfidence) {
+                authorityName = matches[0]->GetAuthorityName(nullptr);
+                authorityCode = matches[0]->GetAuthorityCode(nullptr);
+                if (authorityName != nullptr && authorityCode != nullptr) {
+                    entry->info.authStr = string(authorityName) + ":" + string(authorityCode);
+                }
+            }
+            if (matches != nullptr) {
+                OSRFreeSRSArray(reinterpret_cast<OGRSpatialReferenceH *>(matches));
+            }
+            CPLFree(confidence);
+        });
+        return entry->info;
+    }
+
+    // Number of vertices of a geometry, rings and parts included
+    GIntBig countVertices(const OGRGeometry *geometry) {
+        OGRwkbGeometryType type = wkbFlatten(geometry->getGeometryType());
+        GIntBig count{0};
+        if (type == wkbPoint) {
+            count = geometry->IsEmpty() ? 0 : 1;
+        } else if (OGR_GT_IsCurve(type)) {
+            count = geometry->toCurve()->getNumPoints();
+        } else if (OGR_GT_IsSubClassOf(type, wkbCurvePolygon)) {
+            const OGRCurvePolygon *polygon = geometry->toCurvePolygon();
+            if (polygon->getExteriorRingCurve() != nullptr) {
+                count = polygon->getExteriorRingCurve()->getNumPoints();
+            }
+            for (int r = 0; r < polygon->getNumInteriorRings(); r++) {
+                count += polygon->getInteriorRingCurve(r)->getNumPoints();
+            }
+        } else if (OGR_GT_IsSubClassOf(type, wkbGeometryCollection)) {
+            const OGRGeometryCollection *collection = geometry->toGeometryCollection();
+            for (int g = 0; g < collection->getNumGeometries(); g++) {
+                count += countVertices(collection->getGeometryRef(g));
+            }
+        } else if (OGR_GT_IsSubClassOf(type, wkbPolyhedralSurface)) {
+            const OGRPolyhedralSurface *surface = geometry->toPolyhedralSurface();
+            for (int g = 0; g < surface->getNumGeometries(); g++) {
+                count += countVertices(surface->getGeometryRef(g));
+            }
+        }
+        return count;
+    }
+
+    // Reads every feature of the layer once. The extent is merged from the geometries' own envelopes, which OGR
+    // computes in one tight loop over the coordinates it already holds.
+    layerProfile profileLayer(OGRLayer *layer) {
+        layerProfile stats;
+        stats.profiled = true;
+        layer->ResetReading();
+        OGRFeatureUniquePtr poFeature;
+        while ((poFeature = OGRFeatureUniquePtr(layer->GetNextFeature())) != nullptr) {
+            const OGRGeometry *geometry = poFeature->GetGeometryRef();
+            if (geometry == nullptr) {
+                stats.nullGeometries++;
+                continue;
+            }
+            stats.hasZ = stats.hasZ || geometry->Is3D();
+            stats.hasM = stats.hasM || geometry->IsMeasured();
+            if (geometry->IsEmpty()) {
+                stats.emptyGeometries++;
+                continue;
+            }
+            OGREnvelope envelope;
+            geometry->getEnvelope(&envelope);
+            stats.extent.Merge(envelope);
+            GIntBig vertices = countVertices(geometry);
+            stats.minVertices = stats.geometries == 0 ? vertices : min(stats.minVertices, vertices);
+            stats.maxVertices = max(stats.maxVertices, vertices);
+            stats.vertices += vertices;
+            stats.geometries++;
+        }
+        return stats;
+    }
+
+    // Checks eight bytes at a time while the text is ASCII, which is most of it in practice, and decodes the
+    // multi-byte sequences in between one by one. Overlong forms and surrogates are rejected.
+    bool validUtf8(const char *text, size_t length) {
+        auto *p = (const unsigned char *) text;
+        size_t i{0};
+        while (i < length) {
+            if (length - i >= 8) {
+                uint64_t word;
+                memcpy(&word, p + i, sizeof(word));
+                if ((word & 0x8080808080808080ULL) == 0) {
+                    i += 8;
+                    continue;
+                }
+            }
+            unsigned char c = p[i];
+            if (c < 0x80) {
+                i++;
+                continue;
+            }
+            size_t continuation;
+            uint32_t codePoint;
+            if ((c & 0xE0) == 0xC0) {
+                continuation = 1;
+                codePoint = c & 0x1F;
+            } else if ((c & 0xF0) == 0xE0) {
+                continuation = 2;
+                codePoint = c & 0x0F;
+            } else if ((c & 0xF8) == 0xF0) {
+                continuation = 3;
+                codePoint = c & 0x07;
+            } else {
+                return false;
+            }
+            if (length - i <= continuation) {
+                return false;
+            }
+            for (size_t k = 1; k <= continuation; k++) {
+                if ((p[i + k] & 0xC0) != 0x80) {
+                    return false;
+                }
+                codePoint = codePoint << 6 | (p[i + k] & 0x3F);
+            }
+            const uint32_t smallest[]{0, 0x80, 0x800, 0x10000};
+            if (codePoint < smallest[continuation] || codePoint > 0x10FFFF ||
+                (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+                return false;
+            }
+            i += continuation + 1;
+        }
+        return true;
+    }
+
+    // The PostgreSQL name of a code page as written in .cpg files, e.g. "UTF-8", "1252", "ANSI 1252" or
+    // "ISO-8859-1". Empty when PostgreSQL has no client encoding for it.
+    string pgEncodingOf(string codePage) {
+        string name;
+        for (char c: codePage) {
+            if (!isspace((unsigned char) c)) {
+                name += (char) toupper((unsigned char) c);
+            }
+        }
+        if (name == "UTF-8" || name == "UTF8") {
+            return "UTF8";
+        }
+        if (name == "KOI8-R" || name == "KOI8R") {
+            return "KOI8R";
+        }
+        for (const char *prefix: {"ISO-8859-", "ISO8859-", "ISO8859_", "8859-", "8859_", "ISO88591"}) {
+            if (name.rfind(prefix, 0) == 0) {
+                string part = prefix == string("ISO88591") ? name.substr(7) : name.substr(strlen(prefix));
+                const unordered_map<string, string> iso{{"1", "LATIN1"}, {"2", "LATIN2"}, {"3", "LATIN3"},
+                                                        {"4", "LATIN4"}, {"5", "ISO_8859_5"}, {"6", "ISO_8859_6"},
+                                                        {"7", "ISO_8859_7"}, {"8", "ISO_8859_8"}, {"9", "LATIN5"},
+                                                        {"10", "LATIN6"}, {"13", "LATIN7"}, {"14", "LATIN8"},
+                                                        {"15", "LATIN9"}, {"16", "LATIN10"}};
+                auto found = iso.find(part);
+                return found == iso.end() ? "" : found->second;
+            }
+        }
+        for (const char *prefix: {"ANSI", "WINDOWS-", "WINDOWS", "CP", "WIN", "OEM"}) {
+            if (name.rfind(prefix, 0) == 0) {
+                name = name.substr(strlen(prefix));
+                break;
+            }
+        }
+        const unordered_map<string, string> windows{{"1250", "WIN1250"}, {"1251", "WIN1251"}, {"1252", "WIN1252"},
+                                                    {"1253", "WIN1253"}, {"1254", "WIN1254"}, {"1255", "WIN1255"},
+                                                    {"1256", "WIN1256"}, {"1257", "WIN1257"}, {"1258", "WIN1258"},
+                                                    {"866", "WIN866"}, {"874", "WIN874"}, {"932", "SJIS"},
+                                                    {"936", "GBK"}, {"949", "UHC"}, {"950", "BIG5"},
+                                                    {"65001", "UTF8"}, {"28591", "LATIN1"}};
+        auto found = windows.find(name);
+        return found == windows.end() ? "" : found->second;
+    }
+
+    // Code pages of the language driver IDs in byte 29 of a DBF header, as far as PostgreSQL can take them. 87
+    // is read as ISO-8859-1, like GDAL does.
+    string pgEncodingOfLdid(unsigned char ldid) {
+        const unordered_map<unsigned char, string> codePages{{0x03, "1252"}, {0x57, "ISO-8859-1"}, {0x26, "866"},
+                                                             {0x65, "866"}, {0x7C, "874"}, {0x13, "932"},
+                                                             {0x7B, "932"}, {0x4D, "936"}, {0x7A, "936"},
+                                                             {0x4E, "949"}, {0x79, "949"}, {0x4F, "950"},
+                                                             {0x78, "950"}, {0xC8, "1250"}, {0xC9, "1251"},
+                                                             {0xCA, "1254"}, {0xCB, "1253"}, {0xCC, "1257"},
+                                                             {0x7D, "1255"}, {0x7E, "1256"}};
+        auto found = codePages.find(ldid);
+        return found == codePages.end() ? "" : pgEncodingOf(found->second);
+    }
+
+    // Reads the code page of a Shapefile from its .cpg file, or else from the language driver ID of its .dbf
+    pair<string, string> shapefileEncoding(const string &file) {
+        string base = file.substr(0, file.size() - filesystem::path(file).extension().string().size());
+        for (const char *extension: {".cpg", ".CPG"}) {
+            VSILFILE *fp = VSIFOpenL((base + extension).c_str(), "rb");
+            if (fp != nullptr) {
+                char codePage[64]{};
+                VSIFReadL(codePage, 1, sizeof(codePage) - 1, fp);
+                VSIFCloseL(fp);
+                return {pgEncodingOf(codePage), "cpg"};
+            }
+        }
+        for (const char *extension: {".dbf", ".DBF"}) {
+            VSILFILE *fp = VSIFOpenL((base + extension).c_str(), "rb");
+            if (fp != nullptr) {
+                unsigned char header[32]{};
+                size_t read = VSIFReadL(header, 1, sizeof(header), fp);
+                VSIFCloseL(fp);
+                return {read == sizeof(header) ? pgEncodingOfLdid(header[29]) : "", "ldid"};
+            }
+        }
+        return {"", ""};
+    }
+
+    // Analyzes one layer of an open dataset
+    layer analyzeLayer(GDALDataset *poDS, int i, const string &file, const sourceKey &key) {
+        string wktString;
+        string authStr{"-"};
+        string hasWkt{"True"};
+        OGRLayer *layer{poDS->GetLayer(i)};
+        const OGRSpatialReference *reference = layer->GetSpatialRef();
+        if (reference != nullptr) {
+            const srsInfo &srs = resolveSrs(layer->GetLayerDefn()->OGRFeatureDefn::GetGeomFieldDefn(0)->GetSpatialRef());
+            wktString = srs.wkt;
+            authStr = srs.authStr;
+        } else {
+            hasWkt = "False";
+        }
+        // Count features. Unless an exact count is asked for, only counts the driver has at hand are used, like
+        // the Shapefile header or gpkg_ogr_contents. Anything else would mean reading the whole layer.
+        GIntBig featureCount = exactCount || layer->TestCapability(OLCFastFeatureCount) ?
+                               layer->GetFeatureCount(1) : -1;
+        string type;
+        string typeDeteced;
+        string typeFromLayer;
+        string tmpType;
+        bool singleMultiMixed{false};
+        typeFromLayer = getGeomType(layer->GetGeomType());
+        // The import runs with the client encoding found here. Strings GDAL has recoded to UTF-8 are taken as
+        // that, then the Shapefile's own code page. Otherwise the sampled strings decide.
+        string encoding{"UTF8"};
+        string encodingSource{"driver"};
+        if (!layer->TestCapability(OLCStringsAsUTF8) && strcmp(poDS->GetDriverName(), "ESRI Shapefile") == 0) {
+            tie(encoding, encodingSource) = shapefileEncoding(file);
+        }
+        bool sampleEncoding = !layer->TestCapability(OLCStringsAsUTF8) && encoding.empty();
+        if (sampleEncoding) {
+            encoding = "UTF8";
+            encodingSource = "sample";
+        }
+        // Only geometries, and strings when the encoding is sampled, are looked at while sampling. So the driver
+        // is told to skip decoding the other attributes and the style string. They are restored afterwards, as
+        // the import may read from the same handle.
+        OGRFeatureDefn *featureDefn = layer->GetLayerDefn();
+        vector<const char *> ignoredFields;
+        vector<int> stringFields;
+        for (int f = 0; f < featureDefn->GetFieldCount(); f++) {
+            if (sampleEncoding && featureDefn->GetFieldDefn(f)->GetType() == OFTString) {
+                stringFields.push_back(f);
+            } else {
+                ignoredFields.push_back(featureDefn->GetFieldDefn(f)->GetNameRef());
+            }
+        }
+        ignoredFields.push_back("OGR_STYLE");
+        ignoredFields.push_back(nullptr);
+        bool fieldsIgnored = layer->TestCapability(OLCIgnoreFields) &&
+                             layer->SetIgnoredFields(ignoredFields.data()) == OGRERR_NONE;
+        // Drivers that can seek cheaply get a stratified sample spread over the whole layer, so layers sorted
+        // by type are caught. Others are scanned from the start as before. Either way at most maxFeatures
+        // features are read, and each is released as soon as it's been looked at.
+        bool stratified = featureCount > maxFeatures && layer->TestCapability(OLCFastSetNextByIndex);
+        int stable{0};
+        OGRFeatureUniquePtr poFeature;
+        for (int n = 0; n < maxFeatures; n++) {
+            if (stratified && layer->SetNextByIndex(samplePosition(n, featureCount)) != OGRERR_NONE) {
+                stratified = false;
+                layer->ResetReading();
+            }
+            poFeature.reset(layer->GetNextFeature());
+            if (poFeature == nullptr) {
+                break;
+            }
+            for (size_t f = 0; encoding == "UTF8" && f < stringFields.size(); f++) {
+                if (poFeature->IsFieldSetAndNotNull(stringFields[f])) {
+                    const char *text = poFeature->GetFieldAsString(stringFields[f]);
+                    if (!validUtf8(text, strlen(text))) {
+                        encoding = fallbackEncoding;
+                        encodingSource = "sample-invalid";
+                    }
+                }
+            }
+            OGRGeometry *poGeometry = poFeature->GetGeometryRef();
+            if (poGeometry != nullptr) {
+                typeDeteced = getGeomType(wkbFlatten(poGeometry->getGeometryType()));
+            }
+            if (!tmpType.empty() && tmpType != typeDeteced) {
+                if (tmpType != "multi" + typeDeteced && "multi" + tmpType != typeDeteced) {
+                    typeDeteced = "geometry";
+                    break;
+                }
+                singleMultiMixed = true;
+                stable = 0;
+            }
+            tmpType = typeDeteced;
+            // Stop once the type has held long enough that anything unseen is rare
+            if (stratified && ++stable >= stableSamples) {
+                break;
+            }
+        }
+        layerProfile stats;
+        if (profile) {
+            stats = profileLayer(layer);
+            // The pass has counted the features anyway
+            if (featureCount < 0) {
+                featureCount = stats.nullGeometries + stats.emptyGeometries + stats.geometries;
+            }
+        }
+        if (fieldsIgnored) {
+            layer->SetIgnoredFields(nullptr);
+        }
+        // The handle is cached, so the next reader of the layer has to start from the beginning
+        layer->ResetReading();
+        if (singleMultiMixed || typeFromLayer.empty()) {
+            type = typeDeteced;
+        } else {
+            type = typeFromLayer;
+        }
+        struct layer l = {poDS->GetDriverName(), featureCount, type, layer->GetName(), hasWkt, file,
+                   wktString, authStr, i, "", singleMultiMixed, key, stats};
+        l.encoding = encoding;
+        l.encodingSource = encodingSource;
+        return l;
+    }
+
+    // Layers of a multi-layer dataset are analyzed as separate tasks, each with its own handle on the dataset. The
+    // records are handed on in layer order, every one as soon as all layers before it are done.
+    struct datasetScan {
+        string file;
+        sourceKey key;
+        std::mutex scanMutex;
+        vector<optional<layer>> results;
+        size_t next{0};
+    };
+    struct layerTask {
+        shared_ptr<datasetScan> scan;
+        int layerIndex{0};
+    };
+    bounded_queue<layerTask> layerQueue{queueCapacity};
+
+    void finishLayer(datasetScan &scan, int i, const layer &l) {
+        vector<size_t> indexes;
+        bool complete;
+        {
+            std::scoped_lock lock(scan.scanMutex);
+            scan.results[i] = l;
+            for (; scan.next < scan.results.size() && scan.results[scan.next]; scan.next++) {
+                indexes.push_back(storeLayer(*scan.results[scan.next]));
+                scan.results[scan.next].reset();
+            }
+            complete = !indexes.empty() && scan.next == scan.results.size();
+        }
+        for (size_t index: indexes) {
+            importStored(index);
+        }
+        if (complete) {
+            tickRead();
+        }
+    }
+
+    void analyzeQueuedLayer(const layerTask &task) {
+        datasetScan &scan = *task.scan;
+        layer l = {"", 0, "", "", "", scan.file, "", "", task.layerIndex, "", false, scan.key};
+        CPLPushErrorHandlerEx(&openErrorHandler, &l);
+        GDALDataset *poDS = openCached(scan.file);
+        if (poDS == nullptr || task.layerIndex >= poDS->GetLayerCount()) {
+            l.error = !l.error.empty() ? l.error : "Unable to open file";
+        } else {
+            l = analyzeLayer(poDS, task.layerIndex, scan.file, scan.key);
+        }
+        CPLPopErrorHandler();
+        finishLayer(scan, task.layerIndex, l);
+    }
+
+    // Every layer but the first is offered to the other workers. The ones that don't fit in the queue, and the
+    // first, are analyzed here on the handle that's already open.
+    void analyzeLayers(GDALDataset *poDS, const string &file, const sourceKey &key, int layerCount) {
+        auto scan = make_shared<datasetScan>();
+        scan->file = file;
+        scan->key = key;
+        scan->results.resize(layerCount);
+        vector<int> local{0};
+        for (int i = 1; i < layerCount; i++) {
+            if (!layerQueue.try_push({scan, i})) {
+                local.push_back(i);
+            }
+        }
+        for (int i: local) {
+            finishLayer(*scan, i, analyzeLayer(poDS, i, file, key));
+        }
+    }
+
+    inline void openSource(string file) {
+        sourceKey key = statSource(file);
+        if (!manifestFile.empty() && key.mtime != 0) {
+            auto cached = manifest.find(file);
+            // Profiles aren't kept in the manifest, so profiling always reads the source
+            if (cached != manifest.end() && cached->second.key == key && !profile &&
+                !(exactCount && any_of(cached->second.layers.begin(), cached->second.layers.end(),
+                                       [](const layer &l) { return l.featureCount < 0; }))) {
+                for (const layer &l: cached->second.layers) {
+                    addLayer(l);
+                }
+                tickRead();
+                return;
+            }
+        }
+        layer l = {"", 0, "", "", "", file, "",
+                   "", 0, "", false, key};
+        CPLPushErrorHandlerEx(&openErrorHandler, &l);
+        GDALDataset *poDS = openCached(file);
+        if (!l.error.empty() || poDS == nullptr) {
+            l.error= !l.error.empty() ? l.error : "Unable to open file";
+            closeCached(file);
+            CPLPopErrorHandler();
+            addLayer(l);
+            tickRead();
+            return;
+        }
+        int layerCount{poDS->GetLayerCount()};
+        if (layerCount > 1) {
+            analyzeLayers(poDS, file, key, layerCount);
+        } else if (layerCount == 1) {
+            l = analyzeLayer(poDS, 0, file, key);
+            addLayer(l);
+            tickRead();
+        } else {
+            tickRead();
+        }
+        CPLPopErrorHandler();
+    }
+
+    // Estimated analysis cost of a source: its size plus the attribute sidecar of Shapefiles (.dbf) and MapInfo
+    // files (.dat). Directory datasets like File Geodatabases are the sum of their files, archive members their
+    // uncompressed size.
+    uint64_t sourceCost(const string &file) {
+        error_code ec;
+        filesystem::path p(file);
+        uint64_t cost{0};
+        if (archiveOf(file) != file) {
+            VSIStatBufL st;
+            return VSIStatL(file.c_str(), &st) == 0 ? (uint64_t) st.st_size : 0;
+        }
+        if (filesystem::is_directory(p, ec)) {
+            for (auto &entry: filesystem::directory_iterator(p, ec)) {
+                uintmax_t size = entry.file_size(ec);
+                cost += ec ? 0 : size;
+            }
+            return cost;
+        }
+        uintmax_t size = filesystem::file_size(p, ec);
+        cost += ec ? 0 : size;
+        vector<string> sidecars;
+        string extension = p.extension().string();
+        if (caseInsCompare(extension, {".shp"})) {
+            sidecars = {".dbf", ".DBF"};
+        } else if (caseInsCompare(extension, {".tab"})) {
+            sidecars = {".dat", ".DAT"};
+        }
+        for (const string &sidecar: sidecars) {
+            size = filesystem::file_size(filesystem::path(p).replace_extension(sidecar), ec);
+            if (!ec) {
+                cost += size;
+                break;
+            }
+        }
+        return cost;
+    }
+
+    // The part of a path below walkRoot. Archive members lose their /vsizip/ or /vsitar/ prefix too.
+    string pathBelowRoot(const string &file) {
+        string path = archiveOf(file) != file ? file.substr(8) : file;
+        if (path.compare(0, walkRoot.size(), walkRoot) == 0) {
+            path = path.substr(walkRoot.size());
+        }
+        return path;
+    }
+
+    // The path a source is sharded on. It's the same on every host as long as they walk the same tree, wherever
+    // it's mounted.
+    string relativePath(const string &file) {
+        return archiveOf(file) != file ? file.substr(0, 8) + pathBelowRoot(file) : pathBelowRoot(file);
+    }
+
+    unsigned shardOf(const string &relative) {
+        auto assigned = shardAssignment.find(relative);
+        if (assigned != shardAssignment.end()) {
+            return assigned->second;
+        }
+        return (unsigned) (fnv1a(relative) % shardCount);
+    }
+
+    // Every matched file is handed to analysis as soon as it is found. While directories are still pending the
+    // max progress is kept one ahead, so the bar doesn't complete before the walk has finished.
+    void addSource(const string &file) {
+        uint64_t cost = sourceCost(file);
+        if (shardCount > 1) {
+            string relative = relativePath(file);
+            if (collecting) {
+                std::scoped_lock lock(shardMutex);
+                shardPlan.emplace_back(relative, cost);
+                return;
+            }
+            unsigned shard = shardOf(relative);
+            {
+                std::scoped_lock lock(shardMutex);
+                shardFiles[shard]++;
+                shardBytes[shard] += cost;
+            }
+            if (shard != shardIndex) {
+                return;
+            }
+        }
+        size_t found = ++filesFound;
+        readBar.set_option(indicators::option::MaxProgress{found + (dirsPending > 0 ? 1 : 0)});
+        sourceQueue.push(file, cost);
+    }
+
+    void importLayer(size_t index) {
+        layer l;
+        {
+            std::scoped_lock lock(mutex);
+            l = layers[index];
+        }
+        // Only a sampled encoding can turn out wrong further into the layer, so only that gets a second attempt
+        // with the fallback encoding
+        bool retry = l.encodingSource == "sample";
+        if (nativeCopy) {
+            copyImport(l, l.encoding, (int) index, retry);
+        } else {
+            translate(l, l.encoding, (int) index, retry);
+        }
+    }
+
+    // All stage workers serve both analysis and import. An analyzed layer is imported by the first worker that
+    // becomes free, and only when there is nothing to import does a worker pick up the next file to analyze.
+    void stageWorker() {
+        string file;
+        size_t index;
+        layerTask task;
+        bool warm{false};
+        while (true) {
+            auto taskStart = chrono::steady_clock::now();
+            if (import && importQueue.try_pop(index)) {
+                importLayer(index);
+                busyMicros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - taskStart).count();
+                continue;
+            }
+            analysesRunning++;
+            // Layers of datasets already opened go before new files, so those datasets are finished first
+            if (layerQueue.try_pop(task)) {
+                analyzeQueuedLayer(task);
+                task = {};
+                analysesRunning--;
+                busyMicros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - taskStart).count();
+                continue;
+            }
+            if (sourceQueue.try_pop(file)) {
+                openSource(file);
+                analysesRunning--;
+                busyMicros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - taskStart).count();
+                continue;
+            }
+            analysesRunning--;
+            if (sourceQueue.drained() && analysesRunning == 0 && layerQueue.empty()) {
+                if (analyzing.exchange(false)) {
+                    std::scoped_lock lock(mutex);
+                    if (import) {
+                        importBar.set_option(indicators::option::MaxProgress{layers.size()});
+                    }
+                    if (peakMemory) {
+                        analyzedResidentKb = residentKb();
+                        analyzedLayers = layers.size();
+                    }
+                }
+                if (importQueue.empty()) {
+                    break;
+                }
+            }
+            if (import && !warm) {
+                warm = true;
+                prewarmConnection();
+                continue;
+            }
+            this_thread::sleep_for(chrono::microseconds(pool.sleep_duration));
+        }
+        closeCachedAll();
+        returnWorkerConnections();
+    }
+
+    bool isDirectoryDataset(const filesystem::path &p) {
+        filesystem::path name = p.has_filename() ? p.filename() : p.parent_path().filename();
+        return caseInsCompare(name.extension().string(), directoryExtensions);
+    }
+
+    // A rule with a slash is matched against the path relative to the walked directory, other rules against the
+    // file or directory name only. So "backup" excludes every directory called backup, while "data/old/*" only
+    // excludes what's in that one directory. As in .gitignore, a trailing slash makes a rule match directories
+    // only, so "backup/" leaves a file called backup alone.
+    bool matchesRule(const string &path, const char *name, const vector<string> &rules, bool isDirectory) {
+        string relative = pathBelowRoot(path);
+        for (const string &rule: rules) {
+            bool directoryOnly = rule.size() > 1 && rule.back() == '/';
+            if (directoryOnly && !isDirectory) {
+                continue;
+            }
+            string pattern = directoryOnly ? rule.substr(0, rule.size() - 1) : rule;
+            const char *subject = pattern.find('/') != string::npos ? relative.c_str() : name;
+            if (fnmatch(pattern.c_str(), subject, 0) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Include rules only apply to sources, so they never stop the walk from reaching a directory
+    bool selected(const string &path, const char *name, bool isDirectory) {
+        if (!excludeRules.empty() && matchesRule(path, name, excludeRules, isDirectory)) {
+            return false;
+        }
+        if (isDirectory && !isDirectoryDataset(path)) {
+            return true;
+        }
+        return includeRules.empty() || matchesRule(path, name, includeRules, isDirectory);
+    }
+
+    // Whether the walker would have pruned dir, i.e. an exclude rule matches it or a directory between it and
+    // walkRoot
+    bool excludedDirectory(const string &dir) {
+        if (excludeRules.empty() || dir == walkRoot || dir + "/" == walkRoot) {
+            return false;
+        }
+        string path = walkRoot;
+        for (const auto &part: filesystem::path(pathBelowRoot(dir))) {
+            if (part.empty() || part == "/") {
+                continue;
+            }
+            path += part.string();
+            if (matchesRule(path, part.c_str(), excludeRules, true)) {
+                return true;
+            }
+            path += "/";
+        }
+        return false;
+    }
+
+    // The virtual file system prefix for an archive, or nullptr if the name isn't an archive
+    const char *archivePrefix(const char *name) {
+        size_t length = strlen(name);
+        for (const auto &archive: archivePrefixes) {
+            const string &ext = archive.first;
+            if (length > ext.size() && strncasecmp(name + length - ext.size(), ext.c_str(), ext.size()) == 0) {
+                return archive.second.c_str();
+            }
+        }
+        return nullptr;
+    }
+
+    // Every member of an archive that is a source on its own. Members inside a .gdb directory in the archive are
+    // covered by the .gdb itself.
+    vector<string> archiveMembers(const string &archive) {
+        vector<string> members;
+        string root = archivePrefix(archive.c_str()) + archive;
+        char **entries = VSIReadDirRecursive(root.c_str());
+        for (char **entry = entries; entry != nullptr && *entry != nullptr; entry++) {
+            string member(*entry);
+            bool isDirectory = !member.empty() && member.back() == '/';
+            if (isDirectory) {
+                member.pop_back();
+            }
+            filesystem::path memberPath(member);
+            bool insideDirectoryDataset{false};
+            for (const filesystem::path &part: memberPath.parent_path()) {
+                insideDirectoryDataset |= hasExtension(part.c_str(), lowercaseDirectoryExtensions);
+            }
+            if (insideDirectoryDataset) {
+                continue;
+            }
+            string name = memberPath.filename().string();
+            if (!hasExtension(name.c_str(), isDirectory ? lowercaseDirectoryExtensions : lowercaseExtensions)) {
+                continue;
+            }
+            string path = root + "/" + member;
+            if (selected(path, name.c_str(), false)) {
+                members.push_back(path);
+            }
+        }
+        CSLDestroy(entries);
+        return members;
+    }
+
+    // Runs on the pool like a directory, so listing a big archive doesn't hold up the walk
+    void walkArchive(const string &archive) {
+        for (const string &member: archiveMembers(archive)) {
+            addSource(member);
+        }
+        if (--dirsPending == 0) {
+            readBar.set_option(indicators::option::MaxProgress{filesFound.load()});
+        }
+    }
+
+    // Layout of the records returned by getdents64
+    struct linuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    // Walks a single directory level. Each subdirectory becomes a new task on the pool, so idle workers pick up
+    // directories while others are still enumerating or analyzing. Entries are read in large batches with getdents64
+    // and classified by d_type, so an entry is only stat'ed when the file system doesn't report its type. Paths are
+    // only built for matches and subdirectories. Excluded directories are never opened.
+    void walkDirectory(const string &dir) {
+        thread_local vector<char> buffer(256 * 1024);
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            string prefix = dir.back() == '/' ? dir : dir + "/";
+            long length;
+            while ((length = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0) {
+                for (long pos = 0; pos < length;) {
+                    auto *entry = (linuxDirent64 *) (buffer.data() + pos);
+                    pos += entry->d_reclen;
+                    const char *name = entry->d_name;
+                    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                        continue;
+                    }
+                    unsigned char type = entry->d_type;
+                    if (type == DT_UNKNOWN) {
+                        struct stat st{};
+                        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                            continue;
+                        }
+                        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+                    }
+                    if (type == DT_DIR) {
+                        string path = prefix + name;
+                        if (!selected(path, name, true)) {
+                            continue;
+                        }
+                        if (hasExtension(name, lowercaseDirectoryExtensions)) {
+                            addSource(path);
+                        } else {
+                            dirsPending++;
+                            pool.push_task(walkDirectory, path);
+                        }
+                    } else if (hasExtension(name, lowercaseExtensions)) {
+                        string path = prefix + name;
+                        if (selected(path, name, false)) {
+                            addSource(path);
+                        }
+                    } else if (archivePrefix(name) != nullptr) {
+                        string path = prefix + name;
+                        if (excludeRules.empty() || !matchesRule(path, name, excludeRules, false)) {
+                            dirsPending++;
+                            pool.push_task(walkArchive, path);
+                        }
+                    }
+                }
+            }
+            close(fd);
+        }
+        if (--dirsPending == 0) {
+            readBar.set_option(indicators::option::MaxProgress{filesFound.load()});
+        }
+    }
+
+    vector<string> profileCells(const layerProfile &stats) {
+        if (!stats.profiled) {
+            return {"", "", "", ""};
+        }
+        char extent[128]{"-"};
+        if (stats.extent.IsInit()) {
+            snprintf(extent, sizeof(extent), "%.10g,%.10g,%.10g,%.10g", stats.extent.MinX, stats.extent.MinY,
+                     stats.extent.MaxX, stats.extent.MaxY);
+        }
+        char vertices[96]{"-"};
+        if (stats.geometries > 0) {
+            snprintf(vertices, sizeof(vertices), "%lld/%.1f/%lld", (long long) stats.minVertices,
+                     (double) stats.vertices / (double) stats.geometries, (long long) stats.maxVertices);
+        }
+        return {extent, vertices, to_string(stats.nullGeometries) + "/" + to_string(stats.emptyGeometries),
+                string("XY") + (stats.hasZ ? "Z" : "") + (stats.hasM ? "M" : "")};
+    }
+
+    // Discovery, analysis and import run as three pipeline stages connected by bounded queues. The walker runs on
+    // the pool and blocks when the analysis stage falls behind. There is no barrier between analysis and import.
+    // discover() feeds the pipeline, and a report is printed when everything it found has been processed.
+    void run(const function<void()> &discover, bool fullRun) {
+        if (!fullRun) {
+            startTime = chrono::high_resolution_clock::now();
+        }
+        filesFound = 0;
+        shardFiles.assign(shardCount, 0);
+        shardBytes.assign(shardCount, 0);
+        busyMicros = 0;
+        layersSkipped = 0;
+        warmResidentKb = 0;
+        layers.clear();
+        analyzing = true;
+        sourceQueue.reopen();
+        auto stageStart = chrono::steady_clock::now();
+        vector<thread> stageThreads;
+        for (unsigned t = 0; t < pool.get_thread_count(); t++) {
+            stageThreads.emplace_back(stageWorker);
+        }
+        discover();
+        pool.wait_for_tasks();
+        sourceQueue.close();
+        for (thread &t: stageThreads) {
+            t.join();
+        }
+        auto stageMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - stageStart).count();
+        double utilization = stageMicros > 0 ? 100.0 * (double) busyMicros / ((double) stageMicros * stageThreads.size()) : 0;
+        if (deferIndex) {
+            buildIndexes();
+        }
+        std::cout << "\r" << std::flush;
+        if (!manifestFile.empty()) {
+            updateManifest(fullRun);
+            saveManifest();
+        }
+        int i{0};
+        // Print out
+        Table table;
+        Table::Row_t header{"Driver", "Count", "Type", "Layer no.", "Name", "Proj", "Auth", "Encoding", "File"};
+        if (profile) {
+            header.insert(header.end(), {"Extent", "Vertices min/mean/max", "Null/Empty", "Dim"});
+        }
+        header.emplace_back("Error");
+        table.add_row(header);
+        table[0].format()
+                .font_align(FontAlign::center)
+                .font_style({FontStyle::underline, FontStyle::bold});
+        i = 0;
+        for (const struct layer &l: layers) {
+            Table::Row_t row{l.driverName, l.featureCount < 0 ? "unknown" : to_string(l.featureCount),
+                             l.type + (l.singleMultiMixed ? "(m)" : ""), to_string(l.layerIndex), l.layerName,
+                             l.hasWkt, l.authStr, l.driverName.empty() ? "" : l.encoding + " (" + l.encodingSource + ")",
+                             l.file};
+            if (profile) {
+                vector<string> cells = profileCells(l.profile);
+                row.insert(row.end(), cells.begin(), cells.end());
+            }
+            row.emplace_back(l.error);
+            table.add_row(row);
+            i++;
+            if (!l.error.empty()) {
+                table[i][row.size() - 1].format().font_color(Color::red);
+            }
+        }
+        std::cout << "\r" << std::flush;
+        std::cout << table << std::endl;
+        auto stopTime = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stopTime - startTime);
+        printf("Total of %zu layer(s) in %zu file(s) processed in %ldms (%.0f%% core utilization) using %s\n",
+               layers.size(), filesFound.load(), lround(duration.count()/1000), utilization,
+               GDALVersionInfo("--version"));
+        if (incremental) {
+            printf("%zu unchanged layer(s) skipped\n", layersSkipped.load());
+        }
+        if (deferIndex) {
+            printf("%zu spatial index(es) built in %ldms\n", indexesBuilt, (long) indexMillis);
+        }
+        if (peakMemory) {
+            struct rusage usage{};
+            getrusage(RUSAGE_SELF, &usage);
+            printf("Peak memory %.1f MB\n", (double) usage.ru_maxrss / 1024);
+            if (warmResidentKb > 0 && analyzedLayers > memoryWarmupLayers) {
+                printf("Resident memory grew %.1f KB per layer over the last %zu analyzed layer(s)\n",
+                       (double) (analyzedResidentKb - warmResidentKb) / (double) (analyzedLayers - memoryWarmupLayers),
+                       analyzedLayers - memoryWarmupLayers);
+            }
+        }
+        for (unsigned shard = 0; shardCount > 1 && shard < shardCount; shard++) {
+            printf("Shard %u/%u: %lu file(s), %.1f MB%s\n", shard + 1, shardCount, (unsigned long) shardFiles[shard],
+                   (double) shardBytes[shard] / (1024 * 1024), shard == shardIndex ? " (this run)" : "");
+        }
+        fflush(stdout);
+    }
+
+    // Walks the whole tree once without analyzing anything and hands out the sources largest first, each to the
+    // shard with the least work so far. Every host sees the same tree and ends up with the same assignment.
+    void balanceShards(const string &path) {
+        collecting = true;
+        dirsPending++;
+        pool.push_task(walkDirectory, path);
+        pool.wait_for_tasks();
+        collecting = false;
+        sort(shardPlan.begin(), shardPlan.end(), [](const auto &a, const auto &b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        vector<uint64_t> load(shardCount, 0);
+        for (const auto &source: shardPlan) {
+            auto shard = (unsigned) (min_element(load.begin(), load.end()) - load.begin());
+            shardAssignment[source.first] = shard;
+            load[shard] += source.second;
+        }
+        shardPlan.clear();
+    }
+
+    int startWatching(const string &path, unordered_map<int, string> &watches);
+
+    void watchDirectory(int fd, const string &path, unordered_map<int, string> &watches, time_t synced);
+
+    void start(string path) {
+        GDALAllRegister();
+        if (!isDirectoryDataset(path) && filesystem::is_directory(path)) {
+            if (!nln.empty() && import && !append) {
+                printf("ERROR: Can't use alternative table name for importing directories. All tables will be named alike.\n");
+                exit(1);
+            }
+        } else if (watch) {
+            printf("ERROR: Watch mode needs a directory.\n");
+            exit(1);
+        } else if (!filesystem::exists(path)) {
+            printf("ERROR: Could not open directory or file.\n");
+            exit(1);
+        }
+        walkRoot = path.back() == '/' ? path : path + "/";
+        if (!manifestFile.empty()) {
+            loadManifest();
+        }
+        if (import && incremental) {
+            createImportsTable();
+        }
+        if (import) {
+            bars = make_unique<indicators::MultiProgress<indicators::ProgressBar, 2>>(readBar, importBar);
+        }
+        sourceQueue.set_policy(schedulePolicy);
+        importQueue.set_policy(schedulePolicy);
+        if (shardCount > 1 && shardBalance && !isDirectoryDataset(path) && filesystem::is_directory(path)) {
+            balanceShards(path);
+        }
+        // The watches are in place before the first pass, so what lands during it is picked up afterwards
+        int watchFd{-1};
+        unordered_map<int, string> watches;
+        time_t watchSince = time(nullptr);
+        if (watch) {
+            watchFd = startWatching(path, watches);
+        }
+        run([&path] {
+            if (!isDirectoryDataset(path) && filesystem::is_directory(path)) {
+                dirsPending++;
+                pool.push_task(walkDirectory, path);
+            } else {
+                addSource(path);
+            }
+        }, true);
+        if (watch) {
+            watchDirectory(watchFd, path, watches, watchSince);
+        }
+        closeConnections();
+    }
+
+    // The key of the dataset a changed file belongs to. Files inside a File Geodatabase belong to the .gdb
+    // directory. Other files are keyed on their path without extension, so a .dbf or .prj arriving after its .shp
+    // is debounced together with it.
+    string datasetKey(const filesystem::path &file) {
+        filesystem::path dataset;
+        for (const filesystem::path &part: file) {
+            dataset /= part;
+            if (caseInsCompare(part.extension().string(), directoryExtensions)) {
+                return dataset.string();
+            }
+        }
+        return (file.parent_path() / file.stem()).string();
+    }
+
+    // Resolves a dataset key back to the sources to analyze, i.e. the files next to it with the same name and a
+    // known extension
+    void resolveDataset(const string &key, set<string> &sources) {
+        error_code ec;
+        filesystem::path keyPath(key);
+        if (excludedDirectory(keyPath.parent_path().string())) {
+            return;
+        }
+        if (filesystem::is_directory(key, ec)) {
+            if (selected(key, keyPath.filename().c_str(), true)) {
+                sources.insert(key);
+            }
+            return;
+        }
+        for (auto &entry: filesystem::directory_iterator(keyPath.parent_path(), ec)) {
+            const filesystem::path &p = entry.path();
+            if (p.stem() == keyPath.filename() && caseInsCompare(p.extension().string(), extensions) &&
+                selected(p.string(), p.filename().c_str(), false)) {
+                sources.insert(p.string());
+            } else if (p.stem() == keyPath.filename() && archivePrefix(p.filename().c_str()) != nullptr) {
+                vector<string> members = archiveMembers(p.string());
+                sources.insert(members.begin(), members.end());
+            }
+        }
+    }
+
+    const uint32_t watchMask{IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF};
+
+    // A failed watch is usually fs.inotify.max_user_watches running out, so changes below dir would go unnoticed
+    void addWatch(int fd, const string &dir, unordered_map<int, string> &watches) {
+        int wd = inotify_add_watch(fd, dir.c_str(), watchMask);
+        if (wd < 0) {
+            printf("WARNING: Could not watch %s: %s\n", dir.c_str(), strerror(errno));
+        } else {
+            watches[wd] = dir;
+        }
+    }
+
+    // Watches dir and everything below it. When pending is given, the files already in there are marked as changed,
+    // because they may have been written before the watch was in place. With since only those changed since then
+    // are marked. The inode change time is used, as a file moved into place keeps its mtime.
+    void addWatches(int fd, const string &dir, unordered_map<int, string> &watches,
+                    unordered_map<string, chrono::steady_clock::time_point> *pending, time_t since = 0) {
+        // Also covers directories created while watching
+        if (excludedDirectory(dir)) {
+            return;
+        }
+        addWatch(fd, dir, watches);
+        error_code ec;
+        for (auto it = filesystem::recursive_directory_iterator(dir, ec);
+             !ec && it != filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            error_code typeEc;
+            bool isDirectory = it->is_directory(typeEc) && !it->is_symlink(typeEc);
+            if (!excludeRules.empty() && matchesRule(it->path().string(), it->path().filename().c_str(), excludeRules,
+                                                      isDirectory)) {
+                if (isDirectory) {
+                    it.disable_recursion_pending();
+                }
+                continue;
+            }
+            if (isDirectory) {
+                addWatch(fd, it->path().string(), watches);
+            } else if (pending != nullptr) {
+                struct stat st{};
+                if (since == 0 || (stat(it->path().c_str(), &st) == 0 && st.st_ctime >= since)) {
+                    (*pending)[datasetKey(it->path())] = chrono::steady_clock::now();
+                }
+            }
+        }
+    }
+
+    int startWatching(const string &path, unordered_map<int, string> &watches) {
+        int fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0) {
+            printf("ERROR: Could not start watching %s.\n", path.c_str());
+            exit(1);
+        }
+        addWatches(fd, path, watches, nullptr);
+        return fd;
+    }
+
+    // Runs until killed. Changed datasets are collected until they've been quiet for watchDebounce and then go
+    // through the pipeline as one batch. GDAL drivers stay registered and idle target connections stay open.
+    // No event is lost before synced, so when the kernel's queue overflows the tree is rescanned for files
+    // changed since then.
+    void watchDirectory(int fd, const string &path, unordered_map<int, string> &watches, time_t synced) {
+        unordered_map<string, chrono::steady_clock::time_point> pending;
+        showProgress = false;
+        printf("Watching %s for changes\n", path.c_str());
+        fflush(stdout);
+        alignas(inotify_event) char buffer[64 * 1024];
+        while (true) {
+            int timeout{-1};
+            auto now = chrono::steady_clock::now();
+            for (const auto &p: pending) {
+                auto wait = chrono::duration_cast<chrono::milliseconds>(p.second + watchDebounce - now).count();
+                timeout = timeout < 0 ? (int) max<long>(wait, 0) : min(timeout, (int) max<long>(wait, 0));
+            }
+            pollfd pfd{fd, POLLIN, 0};
+            if (poll(&pfd, 1, timeout) > 0) {
+                time_t readAt = time(nullptr);
+                ssize_t length = read(fd, buffer, sizeof(buffer));
+                now = chrono::steady_clock::now();
+                bool overflow{false};
+                for (char *ptr = buffer; length > 0 && ptr < buffer + length;) {
+                    auto *event = (inotify_event *) ptr;
+                    ptr += sizeof(inotify_event) + event->len;
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        overflow = true;
+                        continue;
+                    }
+                    // The kernel drops the watch of a deleted directory and says so with IN_IGNORED
+                    if (event->mask & IN_IGNORED) {
+                        watches.erase(event->wd);
+                        continue;
+                    }
+                    auto dir = watches.find(event->wd);
+                    if (dir == watches.end() || event->len == 0) {
+                        continue;
+                    }
+                    filesystem::path changed = filesystem::path(dir->second) / event->name;
+                    if (event->mask & IN_ISDIR) {
+                        addWatches(fd, changed.string(), watches, &pending);
+                    } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                        pending[datasetKey(changed)] = now;
+                    }
+                }
+                if (overflow) {
+                    printf("WARNING: Too many changes at once, rescanning %s\n", path.c_str());
+                    fflush(stdout);
+                    addWatches(fd, path, watches, &pending, synced);
+                }
+                // A read that didn't fill the buffer emptied the queue
+                if (length >= 0 && (size_t) length + sizeof(inotify_event) + NAME_MAX + 1 <= sizeof(buffer)) {
+                    synced = readAt;
+                }
+            }
+            now = chrono::steady_clock::now();
+            set<string> sources;
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (now - it->second >= watchDebounce) {
+                    resolveDataset(it->first, sources);
+                    it = pending.erase(it);
+                } else {
+                    it++;
+                }
+            }
+            if (!sources.empty()) {
+                run([&sources] {
+                    for (const string &source: sources) {
+                        addSource(source);
+                    }
+                }, false);
+            }
+        }
+    }
+
+    // Fingerprint of everything a layer is imported from: the state of every file in the source dataset, the layer
+    // and the translate options. An edited .dbf changes it even when the .shp itself is untouched.
+    string importFingerprint(GDALDatasetH sourceDs, const layer &l, char **argv) {
+        uint64_t hash = fnv1a(l.layerName + "\t" + to_string(l.layerIndex));
+        for (char **arg = argv; arg != nullptr && *arg != nullptr; arg++) {
+            hash = fnv1a(string("\t") + *arg, hash);
+        }
+        char **files = GDALDataset::FromHandle(sourceDs)->GetFileList();
+        for (char **f = files; f != nullptr && *f != nullptr; f++) {
+            sourceKey key = statSource(*f);
+            hash = fnv1a(string("\t") + *f + "\t" + to_string(key.size) + "\t" + to_string(key.mtime) + "\t" +
+                         to_string(key.inode), hash);
+        }
+        CSLDestroy(files);
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+        return hex;
+    }
+
+    string importedFingerprintSql(const string &table, const layer &l) {
+        return "SELECT fingerprint FROM " + schema + "." + importsTable + " WHERE table_name = " +
+               quoteLiteral(table) + " AND source = " + quoteLiteral(l.file + ":" + l.layerName);
+    }
+
+    string recordFingerprintSql(const string &table, const layer &l, const string &fingerprint) {
+        return "INSERT INTO " + schema + "." + importsTable + " (table_name, source, fingerprint) VALUES (" +
+               quoteLiteral(table) + ", " + quoteLiteral(l.file + ":" + l.layerName) + ", " +
+               quoteLiteral(fingerprint) + ") ON CONFLICT (table_name, source) DO UPDATE SET " +
+               "fingerprint = EXCLUDED.fingerprint, imported_at = now()";
+    }
+
+    string importedFingerprint(GDALDatasetH pgDs, const string &table, const layer &l) {
+        string sql = importedFingerprintSql(table, l);
+        string fingerprint;
+        OGRLayer *result = GDALDataset::FromHandle(pgDs)->ExecuteSQL(sql.c_str(), nullptr, nullptr);
+        if (result != nullptr) {
+            OGRFeatureUniquePtr feature(result->GetNextFeature());
+            if (feature) {
+                fingerprint = feature->GetFieldAsString(0);
+            }
+            GDALDataset::FromHandle(pgDs)->ReleaseResultSet(result);
+        }
+        return fingerprint;
+    }
+
+    void recordFingerprint(GDALDatasetH pgDs, const string &table, const layer &l, const string &fingerprint) {
+        string sql = recordFingerprintSql(table, l, fingerprint);
+        GDALDataset::FromHandle(pgDs)->ExecuteSQL(sql.c_str(), nullptr, nullptr);
+    }
+
+    // The bookkeeping table lives in the target schema, so every schema has its own record of what was loaded
+    void createImportsTable() {
+        GDALDatasetH pgDs = GDALOpenEx(connection.c_str(), GDAL_OF_UPDATE | GDAL_OF_VECTOR,
+                                       nullptr, nullptr, nullptr);
+        if (pgDs == nullptr) {
+            printf("ERROR: Could not connect to PostgreSQL.\n");
+            exit(1);
+        }
+        string sql = "CREATE TABLE IF NOT EXISTS " + schema + "." + importsTable + " (table_name text NOT NULL, " +
+                     "source text NOT NULL, fingerprint text NOT NULL, imported_at timestamptz NOT NULL DEFAULT now(), " +
+                     "PRIMARY KEY (table_name, source))";
+        GDALDataset::FromHandle(pgDs)->ExecuteSQL(sql.c_str(), nullptr, nullptr);
+        GDALClose(pgDs);
+    }
+
+    // The table a layer is imported into, as given to GDAL with -nln
+    string targetTable(const layer &l) {
+        string altName = l.layerName;
+        if (!nln.empty()) {
+            altName = nln;
+            if (l.layerIndex > 0) {
+                altName = altName + "_" + to_string(l.layerIndex);
+            }
+        }
+        return schema + "." + altName;
+    }
+
+    // Single-part types are promoted when the layer mixes single and multi-part, or when asked to
+    string targetType(const layer &l) {
+        if ((l.type == "point" || l.type == "linestring" || l.type == "polygon") && (l.singleMultiMixed || p_multi)) {
+            return "multi" + l.type;
+        }
+        return l.type;
+    }
+
+    string targetSrs(const layer &l) {
+        return strcmp(l.authStr.c_str(), "-") != 0 ? l.authStr : !t_srs.empty() ? t_srs : "EPSG:4326";
+    }
+
+    // The GDALVectorTranslate arguments for a layer. The native COPY path fingerprints the same arguments, as they
+    // describe what ends up in the table.
+    char **translateArgs(const layer &l, const string &altName) {
+        char **argv{nullptr};
+        argv = CSLAddString(argv, "-f");
+        argv = CSLAddString(argv, "PostgreSQL");
+        if (append) {
+            argv = CSLAddString(argv, "-update");
+            argv = CSLAddString(argv, "-append");
+        }
+        argv = CSLAddString(argv, "-overwrite");
+        argv = CSLAddString(argv, "-lco");
+        argv = CSLAddString(argv, "GEOMETRY_NAME=the_geom");
+        argv = CSLAddString(argv, "-lco");
+        argv = CSLAddString(argv, "FID=gid");
+        argv = CSLAddString(argv, "-lco");
+        argv = CSLAddString(argv, "PRECISION=NO");
+        argv = CSLAddString(argv, "-nlt");
+        argv = CSLAddString(argv, l.type.c_str());
+        // Layers with a projection are read with it as is, only the fallback is given as a source projection.
+        // Handing the layer's WKT back would make GDAL parse it again for every layer.
+        if (l.wktString.empty()) {
+            argv = CSLAddString(argv, "-s_srs"); // source projection
+            argv = CSLAddString(argv, s_srs.c_str());
+        }
+        argv = CSLAddString(argv, "-t_srs");
+        argv = CSLAddString(argv, targetSrs(l).c_str()); // Convert to this
+        argv = CSLAddString(argv, "-nln");
+        argv = CSLAddString(argv, altName.c_str());
+        argv = CSLAddString(argv, l.layerName.c_str());
+        return argv;
+    }
+
+    inline void
+    translate(layer l, const string &encoding, int index, bool first) {
+        ctx myctx = {
+                .layerIndex =  index,
+                .error = false,
+        };
+        CPLPushErrorHandlerEx(&pgErrorHandler, &myctx);
+        setvbuf(stdout, nullptr, _IOFBF, BUFSIZ);
+        string altName = targetTable(l);
+        l.type = targetType(l);
+        char **argv = translateArgs(l, altName);
+
+        GDALDatasetH pgDs = workerConnection(encoding);
+        GDALDatasetH sourceDs = openCached(l.file);
+        // The source can be gone by now, e.g. moved after its handle was evicted, and a new encoding won't help
+        if (sourceDs == nullptr) {
+            {
+                std::scoped_lock lock(mutex);
+                layers[index].error = "Unable to open file";
+            }
+            CSLDestroy(argv);
+            CPLPopErrorHandler();
+            tickImport();
+            return;
+        }
+
+        string fingerprint;
+        if (incremental && pgDs != nullptr) {
+            fingerprint = importFingerprint(sourceDs, l, argv);
+            if (importedFingerprint(pgDs, altName, l) == fingerprint) {
+                layersSkipped++;
+                CSLDestroy(argv);
+                CPLPopErrorHandler();
+                tickImport();
+                return;
+            }
+        }
+
+        // Added after fingerprinting, as it doesn't change what ends up in the table
+        if (deferIndex) {
+            argv = CSLAddString(argv, "-lco");
+            argv = CSLAddString(argv, "SPATIAL_INDEX=NONE");
+        }
+        int bUsageError{FALSE};
+        GDALVectorTranslateOptions *opt = GDALVectorTranslateOptionsNew(argv, nullptr);
+        GDALVectorTranslate(nullptr, pgDs, 1, &sourceDs, opt, &bUsageError);
+        GDALVectorTranslateOptionsFree(opt);
+        // With a deferred index the fingerprint is recorded once the index exists, so a table whose index
+        // failed is imported again on the next run
+        if (!fingerprint.empty() && !myctx.error && !deferIndex) {
+            recordFingerprint(pgDs, altName, l, fingerprint);
+        }
+        if (myctx.error) {
+            dropWorkerConnection();
+        } else if (pgDs != nullptr) {
+            GDALFlushCache(pgDs);
+            if (deferIndex) {
+                deferIndexBuild(altName, (size_t) index,
+                                fingerprint.empty() ? "" : recordFingerprintSql(altName, l, fingerprint));
+            }
+        }
+        CSLDestroy(argv);
+        CPLPopErrorHandler();
+        // If error we try with the fallback encoding
+        if (myctx.error && first) {
+            {
+                std::scoped_lock lock(mutex);
+                layers[index].error = "";
+            }
+            translate(l, fallbackEncoding, index, false);
+            return;
+        }
+        tickImport();
+    }
+
+    // Table and column names are laundered like the GDAL PostgreSQL driver does it
+    string launderName(const string &name) {
+        string laundered = name.substr(0, 63);
+        for (char &c: laundered) {
+            c = (char) tolower((unsigned char) c);
+            if (c == '\'' || c == '-' || c == '#') {
+                c = '_';
+            }
+        }
+        return laundered;
+    }
+
+    string quoteIdentifier(const string &name) {
+        string quoted = "\"";
+        for (char c: name) {
+            quoted += c == '"' ? "\"\"" : string(1, c);
+        }
+        return quoted + "\"";
+    }
+
+    // A table given as schema.name, with the name laundered and quoted
+    string qualifiedTable(const string &table) {
+        size_t dot = table.find('.');
+        return table.substr(0, dot + 1) + quoteIdentifier(launderName(table.substr(dot + 1)));
+    }
+
+    // Named like the GDAL PostgreSQL driver names it
+    string spatialIndexName(const string &table) {
+        return quoteIdentifier(launderName(table.substr(table.find('.') + 1)) + "_the_geom_geom_idx");
+    }
+
+    // Runs a statement on a native connection and returns the error, if any
+    string pgExec(PGconn *conn, const string &sql) {
+        PGresult *result = PQexec(conn, sql.c_str());
+        ExecStatusType status = PQresultStatus(result);
+        PQclear(result);
+        if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK) {
+            return "";
+        }
+        string error = PQerrorMessage(conn);
+        while (!error.empty() && error.back() == '\n') {
+            error.pop_back();
+        }
+        return error;
+    }
+
+    // How a source field is written. Column types follow what the GDAL PostgreSQL driver creates with
+    // PRECISION=NO, and fields it would store as arrays are written as text.
+    enum class copyKind {
+        boolean, int16, int32, int64, float4, float8, text, bytea, date, time, timestamptz
+    };
+    struct copyColumn {
+        int field;
+        string name;
+        copyKind kind;
+        const char *sqlType;
+    };
+
+    copyColumn copyColumnOf(OGRFieldDefn *fieldDefn, int field) {
+        string name = launderName(fieldDefn->GetNameRef());
+        switch (fieldDefn->GetType()) {
+            case OFTInteger:
+                if (fieldDefn->GetSubType() == OFSTBoolean) {
+                    return {field, name, copyKind::boolean, "boolean"};
+                }
+                if (fieldDefn->GetSubType() == OFSTInt16) {
+                    return {field, name, copyKind::int16, "smallint"};
+                }
+                return {field, name, copyKind::int32, "integer"};
+            case OFTInteger64:
+                return {field, name, copyKind::int64, "bigint"};
+            case OFTReal:
+                if (fieldDefn->GetSubType() == OFSTFloat32) {
+                    return {field, name, copyKind::float4, "real"};
+                }
+                return {field, name, copyKind::float8, "double precision"};
+            case OFTBinary:
+                return {field, name, copyKind::bytea, "bytea"};
+            case OFTDate:
+                return {field, name, copyKind::date, "date"};
+            case OFTTime:
+                return {field, name, copyKind::time, "time"};
+            case OFTDateTime:
+                return {field, name, copyKind::timestamptz, "timestamp with time zone"};
+            default:
+                return {field, name, copyKind::text, "varchar"};
+        }
+    }
+
+    void writeCopyField(copy_buffer &buffer, const OGRFeature *feature, const copyColumn &column) {
+        int field = column.field;
+        if (!feature->IsFieldSetAndNotNull(field)) {
+            buffer.null();
+            return;
+        }
+        int year, month, day, hour, minute, tzFlag;
+        float second;
+        int64_t micros;
+        int length;
+        switch (column.kind) {
+            case copyKind::boolean:
+                buffer.boolean(feature->GetFieldAsInteger(field) != 0);
+                break;
+            case copyKind::int16:
+                buffer.int16((int16_t) feature->GetFieldAsInteger(field));
+                break;
+            case copyKind::int32:
+                buffer.int32(feature->GetFieldAsInteger(field));
+                break;
+            case copyKind::int64:
+                buffer.int64(feature->GetFieldAsInteger64(field));
+                break;
+            case copyKind::float4:
+                buffer.float4((float) feature->GetFieldAsDouble(field));
+                break;
+            case copyKind::float8:
+                buffer.float8(feature->GetFieldAsDouble(field));
+                break;
+            case copyKind::bytea: {
+                const unsigned char *data = feature->GetFieldAsBinary(field, &length);
+                buffer.bytes(data, (size_t) length);
+                break;
+            }
+            case copyKind::text: {
+                const char *text = feature->GetFieldAsString(field);
+                buffer.bytes(text, strlen(text));
+                break;
+            }
+            default:
+                feature->GetFieldAsDateTime(field, &year, &month, &day, &hour, &minute, &second, &tzFlag);
+                micros = ((int64_t) hour * 3600 + minute * 60) * 1000000 + llround(second * 1000000.0);
+                if (column.kind == copyKind::date) {
+                    buffer.int32(pg_days(year, month, day));
+                } else if (column.kind == copyKind::time) {
+                    buffer.int64(micros);
+                } else {
+                    // GDAL's time zone flag counts quarter hours from 100 (UTC). Unknown and local times are taken
+                    // as UTC, as binary COPY has no way to leave the zone to the server.
+                    int64_t offsetMinutes = tzFlag > 1 ? (int64_t) (tzFlag - 100) * 15 : 0;
+                    buffer.int64((int64_t) pg_days(year, month, day) * 86400000000LL + micros -
+                                 offsetMinutes * 60000000LL);
+                }
+        }
+    }
+
+    // Writes a geometry as EWKB, which carries the SRID in front of the plain WKB body
+    void writeCopyGeometry(copy_buffer &buffer, const OGRGeometry *geometry, int32_t srid) {
+        size_t size = geometry->WkbSize();
+        if (srid == 0) {
+            geometry->exportToWkb(wkbNDR, (unsigned char *) buffer.reserve(size));
+            return;
+        }
+        auto *out = (unsigned char *) buffer.reserve(size + 4);
+        geometry->exportToWkb(wkbNDR, out + 4);
+        uint32_t type = (uint32_t) out[5] | (uint32_t) out[6] << 8 | (uint32_t) out[7] << 16 | (uint32_t) out[8] << 24;
+        type |= 0x20000000;
+        out[0] = out[4];
+        for (int b = 0; b < 4; b++) {
+            out[1 + b] = (unsigned char) (type >> (8 * b));
+            out[5 + b] = (unsigned char) ((uint32_t) srid >> (8 * b));
+        }
+    }
+
+    OGRwkbGeometryType copyGeometryType(const string &type) {
+        const vector<string> names{"point", "linestring", "polygon", "multipoint", "multilinestring", "multipolygon"};
+        auto name = find(names.begin(), names.end(), type);
+        return name == names.end() ? wkbUnknown : (OGRwkbGeometryType) (name - names.begin() + 1);
+    }
+
+    // Streams the features of a layer into the table in one transaction. The table is created like the GDAL
+    // PostgreSQL driver creates it, with a gid serial key and a the_geom column, and the spatial index is built
+    // after the load.
+    string copyLayer(PGconn *conn, OGRLayer *source, const layer &l, const string &table, const string &fingerprint,
+                     const ctx &myctx) {
+        string qualified = qualifiedTable(table);
+        OGRFeatureDefn *featureDefn = source->GetLayerDefn();
+        vector<copyColumn> columns;
+        for (int f = 0; f < featureDefn->GetFieldCount(); f++) {
+            copyColumn column = copyColumnOf(featureDefn->GetFieldDefn(f), f);
+            if (column.name != "gid" && column.name != "the_geom") {
+                columns.push_back(column);
+            }
+        }
+
+        OGRSpatialReference target;
+        if (target.SetFromUserInput(targetSrs(l).c_str()) != OGRERR_NONE) {
+            return "Invalid target SRS " + targetSrs(l);
+        }
+        target.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+        const char *authorityName = target.GetAuthorityName(nullptr);
+        const char *authorityCode = target.GetAuthorityCode(nullptr);
+        int32_t srid = authorityName != nullptr && authorityCode != nullptr && strcasecmp(authorityName, "EPSG") == 0 ?
+                       atoi(authorityCode) : 0;
+        unique_ptr<OGRSpatialReference, void (*)(OGRSpatialReference *)> sourceSrs(nullptr, [](OGRSpatialReference *srs) {
+            srs->Release();
+        });
+        if (source->GetSpatialRef() != nullptr) {
+            sourceSrs.reset(source->GetSpatialRef()->Clone());
+        } else if (!s_srs.empty()) {
+            sourceSrs.reset(new OGRSpatialReference());
+            if (sourceSrs->SetFromUserInput(s_srs.c_str()) != OGRERR_NONE) {
+                return "Invalid source SRS " + s_srs;
+            }
+        }
+        unique_ptr<OGRCoordinateTransformation, void (*)(OGRCoordinateTransformation *)> transformation(
+                nullptr, OGRCoordinateTransformation::DestroyCT);
+        if (sourceSrs) {
+            sourceSrs->SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+            if (!sourceSrs->IsSame(&target)) {
+                transformation.reset(OGRCreateCoordinateTransformation(sourceSrs.get(), &target));
+                if (!transformation) {
+                    return "Can't transform from the source SRS to " + targetSrs(l);
+                }
+            }
+        }
+
+        OGRwkbGeometryType geometryType = copyGeometryType(l.type);
+        string columnList;
+        string definition = "gid serial PRIMARY KEY";
+        for (const copyColumn &column: columns) {
+            columnList += quoteIdentifier(column.name) + ", ";
+            definition += ", " + quoteIdentifier(column.name) + " " + column.sqlType;
+        }
+        columnList += "the_geom";
+        string upperType = geometryType == wkbUnknown ? "geometry" : l.type;
+        transform(upperType.begin(), upperType.end(), upperType.begin(), ::toupper);
+        definition += ", the_geom geometry(" + upperType + ", " + to_string(srid) + ")";
+
+        string error = pgExec(conn, "BEGIN");
+        if (error.empty() && !append) {
+            error = pgExec(conn, "DROP TABLE IF EXISTS " + qualified + " CASCADE");
+        }
+        if (error.empty()) {
+            error = pgExec(conn, "CREATE TABLE " + string(append ? "IF NOT EXISTS " : "") + qualified + " (" +
+                                 definition + ")");
+        }
+        if (error.empty()) {
+            PGresult *result = PQexec(conn, ("COPY " + qualified + " (" + columnList +
+                                             ") FROM STDIN (FORMAT binary)").c_str());
+            if (PQresultStatus(result) != PGRES_COPY_IN) {
+                error = PQerrorMessage(conn);
+            }
+            PQclear(result);
+        }
+        if (error.empty()) {
+            copy_buffer buffer;
+            buffer.header();
+            source->ResetReading();
+            OGRFeatureUniquePtr feature;
+            while (error.empty() && !myctx.error &&
+                   (feature = OGRFeatureUniquePtr(source->GetNextFeature())) != nullptr) {
+                buffer.begin_row((int16_t) (columns.size() + 1));
+                for (const copyColumn &column: columns) {
+                    writeCopyField(buffer, feature.get(), column);
+                }
+                OGRGeometry *geometry = feature->StealGeometry();
+                if (geometry != nullptr && transformation && geometry->transform(transformation.get()) != OGRERR_NONE) {
+                    error = "Failed to reproject feature " + to_string(feature->GetFID());
+                }
+                if (geometry != nullptr && geometryType != wkbUnknown &&
+                    wkbFlatten(geometry->getGeometryType()) != geometryType) {
+                    geometry = OGRGeometryFactory::forceTo(geometry, geometryType);
+                }
+                if (geometry == nullptr) {
+                    buffer.null();
+                } else {
+                    geometry->flattenTo2D();
+                    geometry->setMeasured(FALSE);
+                    writeCopyGeometry(buffer, geometry, srid);
+                    OGRGeometryFactory::destroyGeometry(geometry);
+                }
+                if (buffer.size() >= copyFlushSize) {
+                    if (PQputCopyData(conn, buffer.data(), (int) buffer.size()) != 1) {
+                        error = PQerrorMessage(conn);
+                    }
+                    buffer.clear();
+                }
+            }
+            source->ResetReading();
+            buffer.trailer();
+            if (error.empty() && !myctx.error && PQputCopyData(conn, buffer.data(), (int) buffer.size()) != 1) {
+                error = PQerrorMessage(conn);
+            }
+            bool aborted = !error.empty() || myctx.error;
+            PQputCopyEnd(conn, aborted ? "Import aborted" : nullptr);
+            PGresult *result;
+            while ((result = PQgetResult(conn)) != nullptr) {
+                if (!aborted && error.empty() && PQresultStatus(result) != PGRES_COMMAND_OK) {
+                    error = PQerrorMessage(conn);
+                }
+                PQclear(result);
+            }
+        }
+        if (error.empty() && !myctx.error && !deferIndex) {
+            error = pgExec(conn, "CREATE INDEX IF NOT EXISTS " + spatialIndexName(table) + " ON " + qualified +
+                                 " USING gist (the_geom)");
+        }
+        if (error.empty() && !myctx.error && !fingerprint.empty() && !deferIndex) {
+            error = pgExec(conn, recordFingerprintSql(table, l, fingerprint));
+        }
+        if (error.empty() && !myctx.error) {
+            error = pgExec(conn, "COMMIT");
+        } else {
+            pgExec(conn, "ROLLBACK");
+        }
+        while (!error.empty() && error.back() == '\n') {
+            error.pop_back();
+        }
+        return error;
+    }
+
+    // The native counterpart of translate(). Errors and the fallback encoding retry work the same way.
+    inline void
+    copyImport(layer l, const string &encoding, int index, bool first) {
+        ctx myctx = {
+                .layerIndex =  index,
+                .error = false,
+        };
+        CPLPushErrorHandlerEx(&pgErrorHandler, &myctx);
+        string table = targetTable(l);
+        l.type = targetType(l);
+        GDALDataset *sourceDs = openCached(l.file);
+        OGRLayer *source = sourceDs == nullptr ? nullptr : sourceDs->GetLayerByName(l.layerName.c_str());
+        PGconn *conn = workerCopyConnection();
+        string error;
+        bool skipped{false};
+        if (source == nullptr) {
+            error = "Unable to open file";
+        } else if (PQstatus(conn) != CONNECTION_OK) {
+            error = PQerrorMessage(conn);
+        } else if (strcasecmp(pg_encoding_to_char(PQclientEncoding(conn)), encoding.c_str()) != 0 &&
+                   PQsetClientEncoding(conn, encoding.c_str()) != 0) {
+            error = "Unknown client encoding " + encoding;
+        } else {
+            string fingerprint;
+            if (incremental) {
+                char **argv = translateArgs(l, table);
+                fingerprint = importFingerprint(sourceDs, l, argv);
+                CSLDestroy(argv);
+                PGresult *result = PQexec(conn, importedFingerprintSql(table, l).c_str());
+                skipped = PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) > 0 &&
+                          fingerprint == PQgetvalue(result, 0, 0);
+                PQclear(result);
+            }
+            if (skipped) {
+                layersSkipped++;
+            } else {
+                error = copyLayer(conn, source, l, table, fingerprint, myctx);
+                if (error.empty() && !myctx.error && deferIndex) {
+                    deferIndexBuild(table, (size_t) index,
+                                    fingerprint.empty() ? "" : recordFingerprintSql(table, l, fingerprint));
+                }
+            }
+        }
+        if (!error.empty()) {
+            std::scoped_lock lock(mutex);
+            layers[index].error = error;
+            myctx.error = true;
+        }
+        // Left in a transaction only after a failure that also broke the rollback
+        if (PQtransactionStatus(conn) != PQTRANS_IDLE) {
+            PQreset(conn);
+        }
+        CPLPopErrorHandler();
+        // If error we try with the fallback encoding
+        if (myctx.error && first) {
+            {
+                std::scoped_lock lock(mutex);
+                layers[index].error = "";
+            }
+            copyImport(l, fallbackEncoding, index, false);
+            return;
+        }
+        tickImport();
+    }
+
+    struct deferredIndex {
+        string table;
+        size_t layerIndex;
+        // Fingerprints of the layers loaded into the table, recorded after the index is built
+        vector<string> fingerprintSql;
+    };
+    std::mutex indexMutex;
+    vector<deferredIndex> deferredIndexes;
+    // Position of each table in deferredIndexes
+    unordered_map<string, size_t> deferredTables;
+
+    // Tables appended to by several layers get one index
+    void deferIndexBuild(const string &table, size_t index, const string &fingerprintSql) {
+        std::scoped_lock lock(indexMutex);
+        auto inserted = deferredTables.emplace(table, deferredIndexes.size());
+        if (inserted.second) {
+            deferredIndexes.push_back({table, index, {}});
+        }
+        if (!fingerprintSql.empty()) {
+            deferredIndexes[inserted.first->second].fingerprintSql.push_back(fingerprintSql);
+        }
+    }
+
+    // Builds the deferred indexes on the pool, each job with its own connection. PostgreSQL builds a GiST index
+    // on a single core, so the parallelism comes from building several at once, each with maintenanceWorkMem.
+    // A failed build is reported on the layer that created the table, and with --incremental the table's
+    // fingerprints are only recorded once its index is built.
+    void buildIndexes() {
+        vector<deferredIndex> pending;
+        {
+            std::scoped_lock lock(indexMutex);
+            pending.swap(deferredIndexes);
+            deferredTables.clear();
+        }
+        auto indexStart = chrono::steady_clock::now();
+        atomic<size_t> next{0};
+        atomic<size_t> built{0};
+        size_t jobs = min((size_t) (indexJobs > 0 ? indexJobs : pool.get_thread_count()), pending.size());
+        for (size_t j = 0; j < jobs; j++) {
+            pool.push_task([&pending, &next, &built] {
+                PGconn *conn = PQconnectdb(connectionInfo().c_str());
+                string error;
+                if (PQstatus(conn) != CONNECTION_OK) {
+                    error = PQerrorMessage(conn);
+                } else if (!maintenanceWorkMem.empty()) {
+                    error = pgExec(conn, "SET maintenance_work_mem TO " + quoteLiteral(maintenanceWorkMem));
+                }
+                for (size_t n = next++; n < pending.size(); n = next++) {
+                    const deferredIndex &index = pending[n];
+                    string indexError = !error.empty() ? error : pgExec(conn, "CREATE INDEX IF NOT EXISTS " +
+                                                                              spatialIndexName(index.table) + " ON " +
+                                                                              qualifiedTable(index.table) +
+                                                                              " USING gist (the_geom)");
+                    if (indexError.empty()) {
+                        built++;
+                        for (const string &sql: index.fingerprintSql) {
+                            if (indexError.empty()) {
+                                indexError = pgExec(conn, sql);
+                            }
+                        }
+                    }
+                    if (!indexError.empty()) {
+                        std::scoped_lock lock(mutex);
+                        layers[index.layerIndex].error = indexError;
+                    }
+                }
+                PQfinish(conn);
+            });
+        }
+        pool.wait_for_tasks();
+        indexesBuilt = built.load();
+        indexMillis = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - indexStart).count();
     }
-}
\ No newline at end of file
+}
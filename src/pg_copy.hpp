@@ -0,0 +1,123 @@
+/*
+ * @author     Martin Høgh <mh@mapcentia.com>
+ * @copyright  2013-2022 MapCentia ApS
+ * @license    http://www.gnu.org/licenses/#AGPL  GNU AFFERO GENERAL PUBLIC LICENSE 3
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace ogr2postgis {
+    /**
+     * Encodes rows in PostgreSQL's binary COPY format. Every value is written in network byte order, prefixed by its
+     * length, and a row starts with its number of fields. The caller sends data() with PQputCopyData whenever size()
+     * has grown large enough and then calls clear().
+     */
+    class copy_buffer {
+    public:
+        void header() {
+            static const char signature[] = "PGCOPY\n\377\r\n";
+            buffer.insert(buffer.end(), signature, signature + sizeof(signature));
+            put<std::int32_t>(0);
+            put<std::int32_t>(0);
+        }
+
+        void trailer() {
+            put<std::int16_t>(-1);
+        }
+
+        void begin_row(std::int16_t fields) {
+            put<std::int16_t>(fields);
+        }
+
+        void null() {
+            put<std::int32_t>(-1);
+        }
+
+        void boolean(bool value) {
+            put<std::int32_t>(1);
+            buffer.push_back(value ? 1 : 0);
+        }
+
+        void int16(std::int16_t value) {
+            put<std::int32_t>(2);
+            put(value);
+        }
+
+        void int32(std::int32_t value) {
+            put<std::int32_t>(4);
+            put(value);
+        }
+
+        void int64(std::int64_t value) {
+            put<std::int32_t>(8);
+            put(value);
+        }
+
+        void float4(float value) {
+            std::int32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            int32(bits);
+        }
+
+        void float8(double value) {
+            std::int64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            int64(bits);
+        }
+
+        // Text and bytea are sent as is. Text must be in the client encoding of the connection.
+        void bytes(const void *data, std::size_t length) {
+            put<std::int32_t>((std::int32_t) length);
+            auto *first = static_cast<const char *>(data);
+            buffer.insert(buffer.end(), first, first + length);
+        }
+
+        // Makes room for a value of the given length and returns where to write it
+        char *reserve(std::size_t length) {
+            put<std::int32_t>((std::int32_t) length);
+            std::size_t offset = buffer.size();
+            buffer.resize(offset + length);
+            return buffer.data() + offset;
+        }
+
+        const char *data() const {
+            return buffer.data();
+        }
+
+        std::size_t size() const {
+            return buffer.size();
+        }
+
+        void clear() {
+            buffer.clear();
+        }
+
+    private:
+        template<typename T>
+        void put(T value) {
+            char bytes[sizeof(T)];
+            for (std::size_t i = 0; i < sizeof(T); i++) {
+                bytes[i] = (char) ((std::uint64_t) value >> (8 * (sizeof(T) - 1 - i)));
+            }
+            buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+        }
+
+        std::vector<char> buffer;
+    };
+
+    // Days from 2000-01-01, PostgreSQL's epoch, to the given date
+    inline std::int32_t pg_days(int year, int month, int day) {
+        // Howard Hinnant's days_from_civil, shifted from the Unix epoch
+        year -= month <= 2;
+        const int era = (year >= 0 ? year : year - 399) / 400;
+        const unsigned yoe = (unsigned) (year - era * 400);
+        const unsigned doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+        const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + (int) doe - 719468 - 10957;
+    }
+}